@@ -0,0 +1,410 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "engine.h"
+#include "simple_shaders.h"
+#include "defs.h"
+
+// Headless benchmark
+// Renders a scene along a scripted camera path as fast as possible, without
+// any window or frame pacing, then reports frame time distribution and
+// throughput. Frames could be dumped as PPM for golden image comparison.
+
+#define DEFAULT_FRAMES  (100)
+
+typedef struct {
+    VEC3 position;
+    float yaw;
+    float pitch;
+} KEYFRAME;
+
+static void usage(const char *name) {
+    printf("Usage: %s [options]\n", name);
+    printf("  -s path/file.obj  Scene to load (default resources/cube.obj)\n");
+    printf("  -S scale          Scene scale (default 1.0)\n");
+    printf("  -n frames         Number of frames to render (default %d)\n",
+            DEFAULT_FRAMES);
+    printf("  -W width          Frame width (default %d)\n", EMU_WIDTH);
+    printf("  -H height         Frame height (default %d)\n", EMU_HEIGHT);
+    printf("  -p path.txt       Camera keyframes, one \"x y z yaw pitch\" per\n");
+    printf("                    line, default orbits around the origin\n");
+    printf("  -d prefix         Dump every frame to <prefix>NNNN.ppm\n");
+    printf("  -t                Enable tiled rendering\n");
+    printf("  -b                Use block rasterizer\n");
+    printf("  -j workers        Worker count for tiled rendering\n");
+    printf("  -T                Report time per pipeline stage (slower)\n");
+    printf("  -r file           Record a Chrome trace of the run\n");
+    printf("  -q                Include every shaded quad in the trace\n");
+    printf("  -c size:line:ways[:r]\n");
+    printf("                    Model a texture cache, sizes in bytes, r for\n");
+    printf("                    random instead of LRU replacement\n");
+    printf("  -m                Store textures in Morton order\n");
+    printf("  -x format         Texture format: rgb8, bc1 or bc3\n");
+    printf("  -f filter[:taps]  Texture filter: nearest, bilinear, trilinear\n");
+    printf("                    or aniso with up to taps taps (default 8)\n");
+}
+
+static bool parse_filter(const char *arg, S3D_SAMPLER *sampler) {
+    static const char *names[] = {"nearest", "bilinear", "trilinear", "aniso"};
+    for (int i = 0; i < 4; i++) {
+        size_t len = strlen(names[i]);
+        if (strncmp(arg, names[i], len) != 0)
+            continue;
+        sampler->filter = (TEX_FILTER)i;
+        sampler->max_anisotropy = 1;
+        if (sampler->filter == TEX_FILTER_ANISOTROPIC)
+            sampler->max_anisotropy = 8;
+        if (arg[len] == ':')
+            sampler->max_anisotropy = atoi(&arg[len + 1]);
+        else if (arg[len] != '\0')
+            return false;
+        return (sampler->max_anisotropy >= 1) &&
+                (sampler->max_anisotropy <= S3D_MAX_ANISOTROPY);
+    }
+    return false;
+}
+
+static double get_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static size_t load_path(const char *fname, KEYFRAME **keyframes) {
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open camera path %s\n", fname);
+        exit(1);
+    }
+    RESIZABLE_ARRAY path;
+    ra_init(&path, sizeof(KEYFRAME));
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        KEYFRAME key;
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%f %f %f %f %f", &key.position.x, &key.position.y,
+                &key.position.z, &key.yaw, &key.pitch) == 5)
+            ra_push(&path, &key);
+    }
+    fclose(fp);
+    if (path.used_size == 0) {
+        fprintf(stderr, "No keyframes in camera path %s\n", fname);
+        exit(1);
+    }
+    *keyframes = path.buf;
+    return path.used_size;
+}
+
+// Interpolate keyframes, evenly spread over all frames
+static void follow_path(CAMERA *camera, KEYFRAME *keyframes, size_t count,
+        int frame, int frames) {
+    float t = (frames > 1) ? (float)frame / (frames - 1) * (count - 1) : 0.0f;
+    size_t i = (size_t)t;
+    if (i >= count - 1)
+        i = (count > 1) ? count - 2 : 0;
+    float factor = (count > 1) ? t - i : 0.0f;
+    KEYFRAME *k0 = &keyframes[i];
+    KEYFRAME *k1 = &keyframes[(count > 1) ? i + 1 : i];
+    camera->position = vec3_add(k0->position,
+            vec3_scale(vec3_sub(k1->position, k0->position), factor));
+    camera->yaw = k0->yaw + (k1->yaw - k0->yaw) * factor;
+    camera->pitch = k0->pitch + (k1->pitch - k0->pitch) * factor;
+    camera_update(camera);
+}
+
+// Circle around the origin at the starting distance and height
+static void orbit(CAMERA *camera, VEC3 start, int frame, int frames) {
+    float radius = sqrtf(start.x * start.x + start.z * start.z);
+    float angle = atan2f(start.z, start.x) + 2.0f * M_PI * frame / frames;
+    camera_set_position(camera, radius * cosf(angle), start.y,
+            radius * sinf(angle));
+}
+
+static void dump_ppm(const char *prefix, int frame, uint8_t *image,
+        int width, int height) {
+    char fname[256];
+    snprintf(fname, sizeof(fname), "%s%04d.ppm", prefix, frame);
+    FILE *fp = fopen(fname, "wb");
+    if (!fp) {
+        fprintf(stderr, "Unable to write %s\n", fname);
+        return;
+    }
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (int i = 0; i < width * height; i++) {
+        // Pixels are stored as R, G, B, A in memory
+        fwrite(&image[i * 4], 1, 3, fp);
+    }
+    fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+    const char *scene = "resources/cube.obj";
+    float scale = 1.0f;
+    int frames = DEFAULT_FRAMES;
+    int width = EMU_WIDTH;
+    int height = EMU_HEIGHT;
+    const char *path_file = NULL;
+    const char *dump_prefix = NULL;
+    bool tiled = false;
+    bool block = false;
+    int workers = 0;
+    bool stage_timing = false;
+    const char *trace_file = NULL;
+    uint32_t trace_flags = 0;
+    S3D_TEX_CACHE_CONFIG tex_cache = {0};
+    char replacement = 'l';
+    bool morton = false;
+    TEX_FORMAT tex_format = TEX_FORMAT_RGB8;
+    S3D_SAMPLER sampler = {TEX_FILTER_BILINEAR, 1, 0.0f};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:S:n:W:H:p:d:tbj:Tr:qc:mx:f:h")) != -1) {
+        switch (opt) {
+        case 's': scene = optarg; break;
+        case 'S': scale = atof(optarg); break;
+        case 'n': frames = atoi(optarg); break;
+        case 'W': width = atoi(optarg); break;
+        case 'H': height = atoi(optarg); break;
+        case 'p': path_file = optarg; break;
+        case 'd': dump_prefix = optarg; break;
+        case 't': tiled = true; break;
+        case 'b': block = true; break;
+        case 'j': workers = atoi(optarg); break;
+        case 'T': stage_timing = true; break;
+        case 'r': trace_file = optarg; break;
+        case 'q': trace_flags |= S3D_TRACE_QUADS; break;
+        case 'm': morton = true; break;
+        case 'x':
+            if (strcmp(optarg, "bc1") == 0)
+                tex_format = TEX_FORMAT_BC1;
+            else if (strcmp(optarg, "bc3") == 0)
+                tex_format = TEX_FORMAT_BC3;
+            else if (strcmp(optarg, "rgb8") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'f':
+            if (!parse_filter(optarg, &sampler)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            sscanf(optarg, "%u:%u:%u:%c", &tex_cache.size,
+                    &tex_cache.line_size, &tex_cache.ways, &replacement);
+            tex_cache.replacement = (replacement == 'r') ?
+                    TEX_CACHE_RANDOM : TEX_CACHE_LRU;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if ((frames < 1) || (width < 1) || (height < 1)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // mesh_load_obj takes directory and file name separately
+    char *dir = strdup(scene);
+    char *slash = strrchr(dir, '/');
+    char *fname = slash ? strdup(slash + 1) : strdup(scene);
+    if (slash)
+        slash[1] = '\0';
+    else
+        dir[0] = '\0';
+
+    S3D_CONTEXT *ctx = s3d_context_create(width, height, NULL);
+    s3d_create_swap_chain(ctx, 2);
+    s3d_tiled_rendering(ctx, tiled);
+    if (block)
+        s3d_set_rasterizer(ctx, RASTERIZER_BLOCK);
+    if (workers > 0)
+        s3d_set_worker_count(ctx, workers);
+    s3d_enable_stats(ctx, true);
+    s3d_enable_stage_timing(ctx, stage_timing);
+    if (tex_cache.size)
+        s3d_set_tex_cache(ctx, &tex_cache);
+    if (morton)
+        s3d_set_tex_layout(ctx, TEX_LAYOUT_MORTON);
+    s3d_set_tex_format(ctx, tex_format);
+    s3d_bind_sampler(ctx, 0, s3d_create_sampler(ctx, &sampler));
+
+    SHADER shader;
+    shader_init(ctx, &shader, &simple_shader_source);
+
+    S3D_VRAM_STATS vram_before, vram_after;
+    s3d_get_vram_stats(ctx, &vram_before);
+    OBJ *obj = mesh_load_obj(ctx, dir, fname, scale);
+    s3d_get_vram_stats(ctx, &vram_after);
+    for (size_t i = 0; i < obj->num_meshes; i++)
+        mesh_init(ctx, &obj->meshes[i]);
+    obj->forward_shader = &shader;
+
+    // Same starting point as the interactive viewer
+    CAMERA camera;
+    camera_init(&camera);
+    camera_set_projection(&camera, RADIAN(PERSPECTIVE_FOV),
+            (float)width / (float)height, Z_NEAR, Z_FAR);
+    camera.position.x = -0.39732;
+    camera.position.y = 1.06948;
+    camera.position.z = 1.54335;
+    camera.yaw = 282.75;
+    camera.pitch = -31.25;
+    camera_update(&camera);
+    VEC3 start = camera.position;
+
+    KEYFRAME *keyframes = NULL;
+    size_t keyframe_count = 0;
+    if (path_file)
+        keyframe_count = load_path(path_file, &keyframes);
+    else
+        camera_toggle_lookat(&camera);
+
+    double *frame_time = malloc(frames * sizeof(double));
+    assert(frame_time);
+    S3D_STATS total_stats = {0};
+    S3D_TEX_CACHE_STATS total_cache_stats = {0};
+    S3D_CMDBUF *cmdbuf = s3d_cmdbuf_create();
+
+    if (trace_file) {
+        s3d_trace_thread_name("bench");
+        if (!s3d_trace_start(trace_file, trace_flags))
+            return 1;
+    }
+    double bench_start = get_time_ms();
+    for (int i = 0; i < frames; i++) {
+        if (path_file)
+            follow_path(&camera, keyframes, keyframe_count, i, frames);
+        else
+            orbit(&camera, start, i, frames);
+
+        double frame_start = get_time_ms();
+        uint8_t *image;
+        s3d_cmdbuf_reset(cmdbuf);
+        s3d_cmd_clear_color(cmdbuf);
+        s3d_cmd_clear_depth(cmdbuf);
+        mesh_render_obj(cmdbuf, obj, &camera, FORWARD_PASS);
+        s3d_cmd_present(cmdbuf, &image);
+        s3d_wait_fence(ctx, s3d_submit(ctx, cmdbuf));
+        frame_time[i] = get_time_ms() - frame_start;
+
+        S3D_STATS stats;
+        s3d_get_stats(ctx, &stats);
+        total_stats.primitives_in += stats.primitives_in;
+        total_stats.quads_generated += stats.quads_generated;
+        total_stats.quad_lanes_active += stats.quad_lanes_active;
+        total_stats.fragments_shaded += stats.fragments_shaded;
+        total_stats.texture_samples += stats.texture_samples;
+        total_stats.texels_fetched += stats.texels_fetched;
+        total_stats.blocks_decoded += stats.blocks_decoded;
+        total_stats.setup_ns += stats.setup_ns;
+        total_stats.rasterize_ns += stats.rasterize_ns;
+        total_stats.fsg_ns += stats.fsg_ns;
+        total_stats.tmu_ns += stats.tmu_ns;
+
+        S3D_TEX_CACHE_STATS cache_stats;
+        s3d_get_tex_cache_stats(ctx, &cache_stats);
+        total_cache_stats.accesses += cache_stats.accesses;
+        total_cache_stats.hits += cache_stats.hits;
+        total_cache_stats.miss_bytes += cache_stats.miss_bytes;
+
+        if (dump_prefix)
+            dump_ppm(dump_prefix, i, image, width, height);
+    }
+    double total = get_time_ms() - bench_start;
+    if (trace_file)
+        s3d_trace_stop();
+
+    double sum = 0.0;
+    for (int i = 0; i < frames; i++)
+        sum += frame_time[i];
+    qsort(frame_time, frames, sizeof(double), compare_double);
+    double render_seconds = sum / 1000.0;
+
+    printf("Rendered %d frames (%d x %d) in %.1f ms\n", frames, width,
+            height, total);
+    printf("Frame time min %.3f ms, avg %.3f ms, p95 %.3f ms, p99 %.3f ms\n",
+            frame_time[0], sum / frames,
+            frame_time[(int)ceil(frames * 0.95) - 1],
+            frame_time[(int)ceil(frames * 0.99) - 1]);
+    printf("Average %.1f FPS, %.0f triangles/s, %.0f fragments/s\n",
+            frames / render_seconds,
+            total_stats.primitives_in / render_seconds,
+            total_stats.fragments_shaded / render_seconds);
+    if (total_stats.quads_generated)
+        printf("Quad lane utilization %.1f%%\n",
+                100.0 * total_stats.quad_lanes_active /
+                (4.0 * total_stats.quads_generated));
+    if (total_stats.texture_samples)
+        printf("%.2f texels per texture sample, %.0f texels per frame\n",
+                (double)total_stats.texels_fetched /
+                total_stats.texture_samples,
+                (double)total_stats.texels_fetched / frames);
+    printf("Scene uses %.1f KB of VRAM\n",
+            (vram_after.used - vram_before.used) / 1024.0);
+    if (total_stats.blocks_decoded)
+        printf("%.0f compressed blocks decoded per frame\n",
+                (double)total_stats.blocks_decoded / frames);
+    if (tex_cache.size && total_cache_stats.accesses) {
+        printf("Texture cache hit rate %.2f%%, %.1f KB per frame from VRAM\n",
+                100.0 * total_cache_stats.hits / total_cache_stats.accesses,
+                total_cache_stats.miss_bytes / 1024.0 / frames);
+    }
+    if (stage_timing) {
+        printf("Stage time per frame: setup %.3f ms, rasterize %.3f ms, "
+                "fsg %.3f ms, tmu %.3f ms\n",
+                total_stats.setup_ns / 1e6 / frames,
+                total_stats.rasterize_ns / 1e6 / frames,
+                total_stats.fsg_ns / 1e6 / frames,
+                total_stats.tmu_ns / 1e6 / frames);
+    }
+
+    s3d_cmdbuf_destroy(cmdbuf);
+    free(frame_time);
+    free(keyframes);
+    free(dir);
+    free(fname);
+    mesh_free_obj(ctx, obj);
+    shader_deinit(ctx, &shader);
+    camera_deinit(&camera);
+    s3d_context_destroy(ctx);
+
+    return 0;
+}
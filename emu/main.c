@@ -26,12 +26,12 @@
 #include <SDL.h>
 #include <math.h>
 #include "engine.h"
+#include "simple_shaders.h"
 #include "defs.h"
 
 #define TEST_CUBE
 //#define TEST_SPONZA
 
-SDL_Surface* semu;  // Frame Buffer
 SDL_Surface* sscr;  // Screen (scaled)
 SDL_Rect rsrc = {
     .x = 0,
@@ -47,6 +47,20 @@ SDL_Rect rdst = {
     };
 
 
+// Show a presented image directly from VRAM, only stretch if scaled
+static void show_frame(uint8_t *image) {
+    SDL_Surface *semu = SDL_CreateRGBSurfaceFrom(image, EMU_WIDTH, EMU_HEIGHT,
+            32, EMU_WIDTH * 4, 0, 0, 0, 0);
+    assert(semu);
+#if EMU_SCALE == 1
+    SDL_BlitSurface(semu, NULL, sscr, NULL);
+#else
+    SDL_SoftStretch(semu, &rsrc, sscr, &rdst);
+#endif
+    SDL_FreeSurface(semu);
+    SDL_Flip(sscr);
+}
+
 static void accelerate(float *speed, float *target) {
     if (fabsf(*speed - *target) > 0.01f) {
         *speed += (*target - *speed) / 8.0f;
@@ -67,14 +81,14 @@ int main(int argc, char *argv[]) {
     SDL_WM_SetCaption("S3D Window", NULL);
 
     sscr = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_SWSURFACE);
-    semu = SDL_CreateRGBSurface(SDL_SWSURFACE, EMU_WIDTH, EMU_HEIGHT, 32, 0, 0, 0, 0);
     assert(sscr);
-    assert(semu);
 
     SDL_WM_GrabInput(SDL_GRAB_ON);
     SDL_WarpMouse(SCREEN_WIDTH/2, SCREEN_HEIGHT/2);
 
-    s3d_init(EMU_WIDTH, EMU_HEIGHT);
+    S3D_CONTEXT *ctx = s3d_context_create(EMU_WIDTH, EMU_HEIGHT, NULL);
+    // Frame N + 1 is rendered while frame N is shown
+    s3d_create_swap_chain(ctx, 2);
     printf("Window created\n");
 
     float aspect = (float)EMU_WIDTH / (float)EMU_HEIGHT;
@@ -96,22 +110,23 @@ int main(int argc, char *argv[]) {
     camera_update(&camera);
 
     SHADER simple_shader;
-    shader_init(&simple_shader, "resources/shaders/simple.vs",
-            "resources/shaders/simple.fs");
+    SHADER depth_shader;
+    shader_init(ctx, &simple_shader, &simple_shader_source);
+    shader_init(ctx, &depth_shader, &depth_shader_source);
 
     OBJ *obj;
 
 #ifdef TEST_SPONZA
-    obj = mesh_load_obj("resources/crytek_sponza/", "sponza.obj", 1.0f);
+    obj = mesh_load_obj(ctx, "resources/crytek_sponza/", "sponza.obj", 1.0f);
 #endif
-    //obj = mesh_load_obj("resources/sponza/", "sponza.obj", 100.0f);
+    //obj = mesh_load_obj(ctx, "resources/sponza/", "sponza.obj", 100.0f);
 #ifdef TEST_CUBE
-    obj = mesh_load_obj("resources/", "cube.obj", 1.0f);
+    obj = mesh_load_obj(ctx, "resources/", "cube.obj", 1.0f);
 #endif
     size_t mesh_total_size = 0;
     size_t mesh_total_tri = 0;
     for (size_t i = 0; i < obj->num_meshes; i++) {
-        mesh_init(&obj->meshes[i]);
+        mesh_init(ctx, &obj->meshes[i]);
         mesh_total_size += mesh_size(&obj->meshes[i]);
         mesh_total_tri += obj->meshes[i].num_indices / 3;
         //mesh_dump(&obj->meshes[i]);
@@ -121,9 +136,11 @@ int main(int argc, char *argv[]) {
     printf("Total size for meshes: %zu KB\n", mesh_total_size / 1024);
 
     obj->forward_shader = &simple_shader;
+    obj->depth_shader = &depth_shader;
 
-    s3d_depth_test(true);
-    s3d_face_culling(true);
+    s3d_depth_test(ctx, true);
+    s3d_face_culling(ctx, true);
+    s3d_tiled_rendering(ctx, true);
 
     bool exit = false;
     float x_velocity = 0.0f;
@@ -142,10 +159,20 @@ int main(int argc, char *argv[]) {
     float perspective_fov = PERSPECTIVE_FOV;
     float ortho_size = ORTHO_SIZE;
 
+    // Double buffered command buffers, the next frame is recorded while the
+    // previous one is rendered
+    S3D_CMDBUF *cmdbuf[2];
+    cmdbuf[0] = s3d_cmdbuf_create();
+    cmdbuf[1] = s3d_cmdbuf_create();
+    uint8_t *image[2];
+    uint32_t frame = 0;
+
     // Simple pipeline
-    mesh_render_obj(obj, &camera, FORWARD_PASS);
-    s3d_render_copy(semu->pixels);
-	SDL_Flip(sscr);
+    mesh_render_obj(cmdbuf[0], obj, &camera, FORWARD_PASS);
+    s3d_cmd_present(cmdbuf[0], &image[0]);
+    S3D_FENCE fence = s3d_submit(ctx, cmdbuf[0]);
+    s3d_wait_fence(ctx, fence);
+    show_frame(image[0]);
 
     float time_delta = 0.0f;
     int last_ticks = SDL_GetTicks();
@@ -254,12 +281,19 @@ int main(int argc, char *argv[]) {
 
         // Simple pipeline
         if (time_delta > 0) {
-            s3d_clear_color();
-            s3d_clear_depth();
-            mesh_render_obj(obj, &camera, FORWARD_PASS);
-            s3d_render_copy(semu->pixels);
-            SDL_SoftStretch(semu, &rsrc, sscr, &rdst);
-            SDL_Flip(sscr);
+            // Recorded while the previous frame is still rendering, this
+            // command buffer was used 2 frames ago and is already done
+            frame++;
+            S3D_CMDBUF *cb = cmdbuf[frame % 2];
+            s3d_cmdbuf_reset(cb);
+            s3d_cmd_clear_color(cb);
+            s3d_cmd_clear_depth(cb);
+            mesh_render_obj(cb, obj, &camera, FORWARD_PASS);
+            s3d_cmd_present(cb, &image[frame % 2]);
+            s3d_wait_fence(ctx, fence);
+            fence = s3d_submit(ctx, cb);
+            // Previous frame is shown while this one is rendered
+            show_frame(image[(frame - 1) % 2]);
         }
         else {
             // skip frame
@@ -273,10 +307,15 @@ int main(int argc, char *argv[]) {
     printf("Camera yaw %.5f, pitch %.5f\n", camera.yaw, camera.pitch);
     print_vec3(camera.position, "Camera position");
 
-    mesh_free_obj(obj);
+    s3d_wait_idle(ctx);
+    s3d_cmdbuf_destroy(cmdbuf[0]);
+    s3d_cmdbuf_destroy(cmdbuf[1]);
+    mesh_free_obj(ctx, obj);
+    shader_deinit(ctx, &simple_shader);
+    shader_deinit(ctx, &depth_shader);
     camera_deinit(&camera);
 
-    s3d_deinit();
+    s3d_context_destroy(ctx);
 
     return 0;
 }
\ No newline at end of file
@@ -157,7 +157,7 @@ static void clear_hashmap_key(struct hashmap_s *hashmap) {
 }
 
 // Return the ID, 1 indexed!
-static size_t mesh_load_texture(MTL *mtl, char *path, char *fname) {
+static size_t mesh_load_texture(S3D_CONTEXT *ctx, MTL *mtl, char *path, char *fname) {
     void * const element = hashmap_get(&mtl->texture_map, fname, strlen(fname));
     if (NULL != element) {
         DEBUG_PRINT("Texture found at ID %u\n", (uint32_t)(intptr_t)element - 1);
@@ -165,7 +165,7 @@ static size_t mesh_load_texture(MTL *mtl, char *path, char *fname) {
     }
     char *texname = strdupcat(path, fname);
     printf("Loading %s\n", texname);
-    TEXTURE texture = texture_load(texname, fname);
+    TEXTURE texture = texture_load(ctx, texname, fname);
     free(texname);
     ra_push(&mtl->textures, &texture);
     assert(hashmap_put(&mtl->texture_map, texture.name, strlen(texture.name),
@@ -173,7 +173,7 @@ static size_t mesh_load_texture(MTL *mtl, char *path, char *fname) {
     return (mtl->textures.used_size);
 }
 
-static void mesh_load_mtl(MTL *mtl, char *path, char *fname) {
+static void mesh_load_mtl(S3D_CONTEXT *ctx, MTL *mtl, char *path, char *fname) {
     FILE *fp;
     char *line = NULL;
     size_t len = 0;
@@ -238,19 +238,19 @@ static void mesh_load_mtl(MTL *mtl, char *path, char *fname) {
             // Ignored
         }
         else if (strcmp(tokens[0], "map_Disp") == 0) {
-            new_material.tex_displace = (TEXTURE *)mesh_load_texture(mtl, path, tokens[1]);
+            new_material.tex_displace = (TEXTURE *)mesh_load_texture(ctx, mtl, path, tokens[1]);
         }
         else if (strcmp(tokens[0], "map_Ka") == 0) {
-            new_material.tex_ambient = (TEXTURE *)mesh_load_texture(mtl, path, tokens[1]);
+            new_material.tex_ambient = (TEXTURE *)mesh_load_texture(ctx, mtl, path, tokens[1]);
         }
         else if (strcmp(tokens[0], "map_Kd") == 0) {
-            new_material.tex_diffuse = (TEXTURE *)mesh_load_texture(mtl, path, tokens[1]);
+            new_material.tex_diffuse = (TEXTURE *)mesh_load_texture(ctx, mtl, path, tokens[1]);
         }
         else if (strcmp(tokens[0], "map_Ks") == 0) {
-            new_material.tex_specular = (TEXTURE *)mesh_load_texture(mtl, path, tokens[1]);
+            new_material.tex_specular = (TEXTURE *)mesh_load_texture(ctx, mtl, path, tokens[1]);
         }
         else if (strcmp(tokens[0], "map_d") == 0) {
-            new_material.tex_alpha = (TEXTURE *)mesh_load_texture(mtl, path, tokens[1]);
+            new_material.tex_alpha = (TEXTURE *)mesh_load_texture(ctx, mtl, path, tokens[1]);
         }
         else {
             if (strcmp(tokens[0], "#") != 0)
@@ -285,7 +285,7 @@ static size_t mesh_find_material(MTL *mtl, char *name) {
 }
 
 // Return the number of meshes loaded
-OBJ *mesh_load_obj(char *path, char *fname, float scale) {
+OBJ *mesh_load_obj(S3D_CONTEXT *ctx, char *path, char *fname, float scale) {
     FILE *fp;
     char *line = NULL;
     size_t len = 0;
@@ -369,7 +369,7 @@ OBJ *mesh_load_obj(char *path, char *fname, float scale) {
             mesh_name = strdup(tokens[1]);
         }
         else if (strcmp(tokens[0], "mtllib") == 0) {
-            mesh_load_mtl(&mtl, path, tokens[1]);
+            mesh_load_mtl(ctx, &mtl, path, tokens[1]);
         }
         else if (strcmp(tokens[0], "usemtl") == 0) {
             mesh_mtl = (MATERIAL *)mesh_find_material(&mtl, tokens[1]);
@@ -407,7 +407,7 @@ OBJ *mesh_load_obj(char *path, char *fname, float scale) {
     hashmap_destroy(&mtl.material_map);
     hashmap_destroy(&mtl.texture_map);
 
-    OBJ *obj = malloc(sizeof(OBJ));
+    OBJ *obj = calloc(1, sizeof(OBJ));
 
     ra_downsize(&obj_meshes);
     obj->meshes = (MESH *)obj_meshes.buf;
@@ -467,9 +467,9 @@ OBJ *mesh_load_obj(char *path, char *fname, float scale) {
     return obj;
 }
 
-void mesh_free_obj(OBJ *obj) {
+void mesh_free_obj(S3D_CONTEXT *ctx, OBJ *obj) {
     for (size_t i = 0; i < obj->num_textures; i++) {
-        texture_free(&obj->textures[i]);
+        texture_free(ctx, &obj->textures[i]);
     }
     free(obj->textures);
     for (size_t i = 0; i < obj->num_materials; i++) {
@@ -478,9 +478,9 @@ void mesh_free_obj(OBJ *obj) {
     free(obj->materials);
     for (size_t i = 0; i < obj->num_meshes; i++) {
         free(obj->meshes[i].name);
-        s3d_delete_vbo(obj->meshes[i].vbo);
-        s3d_delete_ebo(obj->meshes[i].ebo);
-        s3d_delete_vao(obj->meshes[i].vao);
+        s3d_delete_vbo(ctx, obj->meshes[i].vbo);
+        s3d_delete_ebo(ctx, obj->meshes[i].ebo);
+        s3d_delete_vao(ctx, obj->meshes[i].vao);
         free(obj->meshes[i].vertices);
         free(obj->meshes[i].indices);
     }
@@ -526,10 +526,10 @@ void mesh_calculate_normal(MESH *mesh) {
     }
 }*/
 
-void mesh_init(MESH *mesh) {
-    mesh->vbo = s3d_load_vbo(mesh->vertices, mesh->num_vertices * sizeof(VERTEX));
-    mesh->ebo = s3d_load_ebo(mesh->indices, mesh->num_indices * sizeof(uint32_t));
-    mesh->vao = s3d_bind_vao(mesh->ebo, mesh->vbo, 5, 5);
+void mesh_init(S3D_CONTEXT *ctx, MESH *mesh) {
+    mesh->vbo = s3d_load_vbo(ctx, mesh->vertices, mesh->num_vertices * sizeof(VERTEX));
+    mesh->ebo = s3d_load_ebo(ctx, mesh->indices, mesh->num_indices * sizeof(uint32_t));
+    mesh->vao = s3d_bind_vao(ctx, mesh->ebo, mesh->vbo, 5, 5);
 }
 
 // Return size of the mesh in bytes, for VRAM usage estimation
@@ -548,19 +548,30 @@ static bool sphere_within_camera(VEC4 *sphere, CAMERA *camera) {
     return true;
 }
 
-void mesh_render_obj(OBJ *obj, CAMERA *camera, RENDERPASS renderpass) {
-    SHADER *current_shader = NULL;
-    SHADER *new_shader = NULL;
+void mesh_render_obj(S3D_CMDBUF *cmdbuf, OBJ *obj, CAMERA *camera,
+        RENDERPASS renderpass) {
+    SHADER *shader = NULL;
     MATERIAL *current_material = NULL;
+    uint64_t trace = s3d_trace_begin();
+
+    switch (renderpass) {
+    case DEPTH_PASS: shader = obj->depth_shader; break;
+    case DEPTH_PREPASS: shader = obj->depth_alpha_shader; break;
+    case GEOMETRY_PASS: shader = obj->gbuffer_shader; break;
+    case FORWARD_PASS: shader = obj->forward_shader; break;
+    }
 
     // Setup shader
-    if (renderpass == FORWARD_PASS) {
-        s3d_update_uniform(&camera->projection_view_matrix, sizeof(MAT4));
-        s3d_set_varying_count(2);
-        /*shader_use(obj->gbuffer_shader);
-        shader_set_mat4(obj->gbuffer_shader, "projection_view_matrix", &camera->projection_view_matrix);
-        shader_set_mat4(obj->gbuffer_shader, "view_matrix", &camera->view_matrix);
-        shader_set_int(obj->gbuffer_shader, "diffuse_texture", 0);*/
+    if (shader) {
+        shader_use(shader, cmdbuf);
+        shader_set_mat4(shader, "projection_view_matrix", &camera->projection_view_matrix);
+        shader_set_mat4(shader, "view_matrix", &camera->view_matrix);
+        shader_set_int(shader, "diffuse_texture", 0);
+    }
+    else if (renderpass == FORWARD_PASS) {
+        // Default program
+        s3d_cmd_update_uniform(cmdbuf, &camera->projection_view_matrix, sizeof(MAT4));
+        s3d_cmd_set_varying_count(cmdbuf, 2);
     }
 
     int count = 0;
@@ -572,13 +583,13 @@ void mesh_render_obj(OBJ *obj, CAMERA *camera, RENDERPASS renderpass) {
         count++;
 
         // Update shader or material
-        if (renderpass == FORWARD_PASS) {
+        if (renderpass != DEPTH_PASS) {
             if (mesh->material != current_material) {
                 if (mesh->material->tex_diffuse) {
-                    s3d_bind_texture(0, mesh->material->tex_diffuse->id);
+                    s3d_cmd_bind_texture(cmdbuf, 0, mesh->material->tex_diffuse->id);
                 }
                 else {
-                    s3d_bind_texture(0, 0);
+                    s3d_cmd_bind_texture(cmdbuf, 0, 0);
                 }
             }
             current_material = mesh->material;
@@ -586,8 +597,9 @@ void mesh_render_obj(OBJ *obj, CAMERA *camera, RENDERPASS renderpass) {
 
         //printf("Rendering mesh %d\n", i);
         // Render
-        s3d_render(mesh->vao);
+        s3d_cmd_render(cmdbuf, mesh->vao);
         //printf("Done.\n");
     }
     //printf("Rendered %d meshes\n", count);
+    s3d_trace_end("mesh_render_obj", trace);
 }
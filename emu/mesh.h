@@ -82,9 +82,10 @@ typedef struct {
     SHADER *forward_shader;
 } OBJ;
 
-OBJ *mesh_load_obj(char *path, char *fname, float scale);
-void mesh_free_obj(OBJ *obj);
+OBJ *mesh_load_obj(S3D_CONTEXT *ctx, char *path, char *fname, float scale);
+void mesh_free_obj(S3D_CONTEXT *ctx, OBJ *obj);
 void mesh_dump(MESH *mesh);
-void mesh_init(MESH *mesh);
+void mesh_init(S3D_CONTEXT *ctx, MESH *mesh);
 size_t mesh_size(MESH *mesh);
-void mesh_render_obj(OBJ *obj, CAMERA *camera, RENDERPASS renderpass);
+void mesh_render_obj(S3D_CMDBUF *cmdbuf, OBJ *obj, CAMERA *camera,
+        RENDERPASS renderpass);
@@ -0,0 +1,286 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Block compressed textures
+// Textures are encoded into BC1 or BC3 4x4 blocks when loaded, and decoded
+// by the TMU on access. Blocks are stored row-major within a level, levels
+// are stored from the largest one. Decoded blocks are kept in a small direct
+// mapped cache per worker and TMU, only misses read the block from VRAM and
+// go through the texture cache model.
+
+typedef struct {
+    uint32_t tag; // Block address, INVALID_TAG if empty
+    uint8_t texels[16 * 4]; // RGBA8, row-major
+} BC_CACHE_ENTRY;
+
+struct S3D_BC_CACHE {
+    BC_CACHE_ENTRY entries[BC_CACHE_ENTRIES];
+};
+
+#define INVALID_TAG (0xffffffffu)
+
+static uint16_t bc_pack_565(const uint8_t *color) {
+    return ((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3);
+}
+
+static void bc_unpack_565(uint16_t packed, uint8_t *color) {
+    uint8_t r = (packed >> 11) & 0x1f;
+    uint8_t g = (packed >> 5) & 0x3f;
+    uint8_t b = packed & 0x1f;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+    color[3] = 0xff;
+}
+
+// BC3 color blocks always use 4 colors, BC1 only if c0 > c1
+static void bc_color_palette(uint16_t c0, uint16_t c1, bool four_color,
+        uint8_t palette[4][4]) {
+    bc_unpack_565(c0, palette[0]);
+    bc_unpack_565(c1, palette[1]);
+    for (int i = 0; i < 3; i++) {
+        if (four_color || (c0 > c1)) {
+            palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+            palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+        }
+        else {
+            palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+            palette[3][i] = 0;
+        }
+    }
+    palette[2][3] = 0xff;
+    palette[3][3] = (four_color || (c0 > c1)) ? 0xff : 0x00;
+}
+
+static void bc_alpha_palette(uint8_t a0, uint8_t a1, uint8_t palette[8]) {
+    palette[0] = a0;
+    palette[1] = a1;
+    if (a0 > a1) {
+        for (int i = 1; i < 7; i++)
+            palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    }
+    else {
+        for (int i = 1; i < 5; i++)
+            palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+        palette[6] = 0x00;
+        palette[7] = 0xff;
+    }
+}
+
+// Endpoints are the corners of the bounding box of the block colors, inset
+// by 1/16 to reduce the error of the extremes
+static void bc_encode_color(uint8_t texels[16][4], bool four_color,
+        uint8_t *block) {
+    uint8_t min[4] = {0xff, 0xff, 0xff, 0xff};
+    uint8_t max[4] = {0x00, 0x00, 0x00, 0x00};
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 3; c++) {
+            if (texels[i][c] < min[c]) min[c] = texels[i][c];
+            if (texels[i][c] > max[c]) max[c] = texels[i][c];
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        uint8_t inset = (max[c] - min[c]) >> 4;
+        min[c] += inset;
+        max[c] -= inset;
+    }
+    uint16_t c0 = bc_pack_565(max);
+    uint16_t c1 = bc_pack_565(min);
+    if (c0 < c1) {
+        uint16_t temp = c0;
+        c0 = c1;
+        c1 = temp;
+    }
+
+    // Equal endpoints leave all indices at 0
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        uint8_t palette[4][4];
+        bc_color_palette(c0, c1, four_color, palette);
+        for (int i = 0; i < 16; i++) {
+            uint32_t best = 0;
+            int32_t best_error = INT32_MAX;
+            for (uint32_t p = 0; p < 4; p++) {
+                int32_t error = 0;
+                for (int c = 0; c < 3; c++) {
+                    int32_t diff = texels[i][c] - palette[p][c];
+                    error += diff * diff;
+                }
+                if (error < best_error) {
+                    best_error = error;
+                    best = p;
+                }
+            }
+            indices |= best << (2 * i);
+        }
+    }
+    block[0] = c0 & 0xff;
+    block[1] = c0 >> 8;
+    block[2] = c1 & 0xff;
+    block[3] = c1 >> 8;
+    for (int i = 0; i < 4; i++)
+        block[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+static void bc_encode_alpha(uint8_t texels[16][4], uint8_t *block) {
+    uint8_t a0 = 0x00;
+    uint8_t a1 = 0xff;
+    for (int i = 0; i < 16; i++) {
+        if (texels[i][3] > a0) a0 = texels[i][3];
+        if (texels[i][3] < a1) a1 = texels[i][3];
+    }
+
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        uint8_t palette[8];
+        bc_alpha_palette(a0, a1, palette);
+        for (int i = 0; i < 16; i++) {
+            uint64_t best = 0;
+            int32_t best_error = INT32_MAX;
+            for (uint32_t p = 0; p < 8; p++) {
+                int32_t error = abs(texels[i][3] - palette[p]);
+                if (error < best_error) {
+                    best_error = error;
+                    best = p;
+                }
+            }
+            indices |= best << (3 * i);
+        }
+    }
+    block[0] = a0;
+    block[1] = a1;
+    for (int i = 0; i < 6; i++)
+        block[2 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+static void bc_decode_block(TEX_FORMAT format, const uint8_t *block,
+        uint8_t *texels) {
+    const uint8_t *color = block;
+    if (format == TEX_FORMAT_BC3)
+        color += 8;
+    uint16_t c0 = color[0] | (color[1] << 8);
+    uint16_t c1 = color[2] | (color[3] << 8);
+    uint32_t indices = color[4] | (color[5] << 8) | (color[6] << 16) |
+            ((uint32_t)color[7] << 24);
+    uint8_t palette[4][4];
+    bc_color_palette(c0, c1, format == TEX_FORMAT_BC3, palette);
+    for (int i = 0; i < 16; i++)
+        memcpy(&texels[i * 4], palette[(indices >> (2 * i)) & 0x3], 4);
+
+    if (format == TEX_FORMAT_BC3) {
+        uint8_t alpha[8];
+        bc_alpha_palette(block[0], block[1], alpha);
+        uint64_t alpha_indices = 0;
+        for (int i = 0; i < 6; i++)
+            alpha_indices |= (uint64_t)block[2 + i] << (8 * i);
+        for (int i = 0; i < 16; i++)
+            texels[i * 4 + 3] = alpha[(alpha_indices >> (3 * i)) & 0x7];
+    }
+}
+
+// Encode one level of side x side texels, with channels 3 (RGB) or 4 (RGBA)
+// bytes per texel. Levels smaller than a block are padded with edge texels.
+void s3d_bc_encode_level(TEX_FORMAT format, const uint8_t *image,
+        uint32_t side, uint32_t channels, uint8_t *target) {
+    uint32_t blocks = (side >= 4) ? (side / 4) : 1;
+    uint32_t block_size = s3d_bc_block_size(format);
+    for (uint32_t by = 0; by < blocks; by++) {
+        for (uint32_t bx = 0; bx < blocks; bx++) {
+            uint8_t texels[16][4];
+            for (uint32_t i = 0; i < 16; i++) {
+                uint32_t x = bx * 4 + (i & 0x3);
+                uint32_t y = by * 4 + (i >> 2);
+                if (x >= side) x = side - 1;
+                if (y >= side) y = side - 1;
+                const uint8_t *pixel = &image[(y * side + x) * channels];
+                texels[i][0] = pixel[0];
+                texels[i][1] = pixel[1];
+                texels[i][2] = pixel[2];
+                texels[i][3] = (channels == 4) ? pixel[3] : 0xff;
+            }
+            uint8_t *block = &target[(by * blocks + bx) * block_size];
+            if (format == TEX_FORMAT_BC3) {
+                bc_encode_alpha(texels, block);
+                bc_encode_color(texels, true, block + 8);
+            }
+            else {
+                bc_encode_color(texels, false, block);
+            }
+        }
+    }
+}
+
+void s3d_bc_init(S3D_CONTEXT *ctx) {
+    ctx->bc_cache = malloc(MAX_WORKERS * TMU_COUNT * sizeof(S3D_BC_CACHE));
+    assert(ctx->bc_cache);
+    s3d_bc_invalidate(ctx);
+}
+
+void s3d_bc_deinit(S3D_CONTEXT *ctx) {
+    free(ctx->bc_cache);
+    ctx->bc_cache = NULL;
+}
+
+void s3d_bc_invalidate(S3D_CONTEXT *ctx) {
+    for (uint32_t i = 0; i < MAX_WORKERS * TMU_COUNT; i++) {
+        for (uint32_t j = 0; j < BC_CACHE_ENTRIES; j++)
+            ctx->bc_cache[i].entries[j].tag = INVALID_TAG;
+    }
+}
+
+S3D_BC_CACHE *s3d_bc_cache_get(S3D_CONTEXT *ctx, uint32_t tmu_id) {
+    return &ctx->bc_cache[s3d_worker_id() * TMU_COUNT + tmu_id];
+}
+
+// Texel x, y of a level with side 2^level, in RGBA8
+void s3d_bc_fetch(S3D_CONTEXT *ctx, S3D_TEX_CACHE *cache,
+        S3D_BC_CACHE *bc_cache, TMU *tmu, uint32_t level, uint32_t x,
+        uint32_t y, uint8_t *rgba) {
+    uint32_t block_size = s3d_bc_block_size(tmu->format);
+    uint32_t side = 1u << level;
+    uint32_t blocks = (side >= 4) ? (side / 4) : 1;
+    uint32_t block = s3d_bc_level_offset(tmu->mipmap_levels, level) +
+            (y / 4) * blocks + (x / 4);
+    uint32_t address = tmu->address + block * block_size;
+
+    // Indexed by block position, so a 4x4 area of blocks never conflicts
+    uint32_t index = (((y / 4) & 0x3) << 2) | ((x / 4) & 0x3);
+    BC_CACHE_ENTRY *entry = &bc_cache->entries[index];
+    if (entry->tag != address) {
+        if (cache)
+            s3d_tex_cache_access(ctx, cache, address);
+        bc_decode_block(tmu->format, &ctx->vram[address], entry->texels);
+        entry->tag = address;
+        if (ctx->stats_enabled)
+            S3D_STAT_ADD(ctx->stats.blocks_decoded, 1);
+    }
+    memcpy(rgba, &entry->texels[((y % 4) * 4 + (x % 4)) * 4], 4);
+}
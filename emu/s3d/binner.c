@@ -0,0 +1,167 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Sort-middle tiled rendering
+// Triangles are set up and clipped as usual, but instead of being rasterized
+// right away, they are stored into a triangle buffer and binned into every
+// tile they overlap. On flush, tiles are handed out to the worker pool.
+// Each tile owns its part of the color and depth buffer, and triangles within
+// a bin are kept in submission order, so the result is the same as the serial
+// path.
+
+struct S3D_TILER {
+    S3D_CONTEXT *ctx;
+    RESIZABLE_ARRAY triangles;
+    RESIZABLE_ARRAY *bins;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint32_t fbo_id;
+};
+
+static void s3d_tiler_render_tile(void *arg, uint32_t tile) {
+    S3D_TILER *tiler = arg;
+    S3D_CONTEXT *ctx = tiler->ctx;
+    RESIZABLE_ARRAY *bin = &tiler->bins[tile];
+    if (bin->used_size == 0)
+        return;
+
+    uint64_t trace = s3d_trace_begin();
+    FBO fbo = ((FBO *)ctx->fbo.buf)[tiler->fbo_id];
+    S3D_RECT rect;
+    rect.x0 = (tile % tiler->tiles_x) * TILE_SIZE;
+    rect.y0 = (tile / tiler->tiles_x) * TILE_SIZE;
+    rect.x1 = MIN(rect.x0 + TILE_SIZE, (int32_t)fbo.width);
+    rect.y1 = MIN(rect.y0 + TILE_SIZE, (int32_t)fbo.height);
+
+    uint32_t *indices = (uint32_t *)bin->buf;
+    SETUP_TRIANGLE *triangles = (SETUP_TRIANGLE *)tiler->triangles.buf;
+    for (size_t i = 0; i < bin->used_size; i++) {
+        s3d_rasterize_triangle(ctx, &triangles[indices[i]], &rect);
+    }
+    bin->used_size = 0;
+    s3d_trace_end("tile", trace);
+}
+
+// Resize bins to match the active framebuffer
+static void s3d_tiler_resize(S3D_CONTEXT *ctx, S3D_TILER *tiler) {
+    FBO fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+    uint32_t tiles_x = (fbo.width + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tiles_y = (fbo.height + TILE_SIZE - 1) / TILE_SIZE;
+    tiler->fbo_id = ctx->active_fbo;
+    if ((tiles_x == tiler->tiles_x) && (tiles_y == tiler->tiles_y))
+        return;
+    for (uint32_t i = 0; i < tiler->tiles_x * tiler->tiles_y; i++)
+        ra_deinit(&tiler->bins[i]);
+    free(tiler->bins);
+    tiler->tiles_x = tiles_x;
+    tiler->tiles_y = tiles_y;
+    tiler->bins = malloc(tiles_x * tiles_y * sizeof(RESIZABLE_ARRAY));
+    assert(tiler->bins);
+    for (uint32_t i = 0; i < tiles_x * tiles_y; i++)
+        ra_init(&tiler->bins[i], sizeof(uint32_t));
+}
+
+void s3d_tiler_init(S3D_CONTEXT *ctx) {
+    S3D_TILER *tiler = calloc(1, sizeof(S3D_TILER));
+    assert(tiler);
+    tiler->ctx = ctx;
+    ra_init(&tiler->triangles, sizeof(SETUP_TRIANGLE));
+    ctx->tiler = tiler;
+}
+
+void s3d_tiler_deinit(S3D_CONTEXT *ctx) {
+    S3D_TILER *tiler = ctx->tiler;
+    for (uint32_t i = 0; i < tiler->tiles_x * tiler->tiles_y; i++)
+        ra_deinit(&tiler->bins[i]);
+    free(tiler->bins);
+    ra_deinit(&tiler->triangles);
+    free(tiler);
+    ctx->tiler = NULL;
+}
+
+void s3d_bin_triangle(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri) {
+    S3D_TILER *tiler = ctx->tiler;
+    if (tiler->triangles.used_size == 0)
+        s3d_tiler_resize(ctx, tiler);
+
+    int32_t x0 = tri->x[0];
+    int32_t y0 = tri->y[0];
+    int32_t x1 = tri->x[1];
+    int32_t y1 = tri->y[1];
+    int32_t x2 = tri->x[2];
+    int32_t y2 = tri->y[2];
+
+    int32_t left = MIN(x0, x1);
+    left = MIN(left, x2);
+    int32_t right = MAX(x0, x1);
+    right = MAX(right, x2);
+    int32_t top = MIN(y0, y1);
+    top = MIN(top, y2);
+    int32_t bottom = MAX(y0, y1);
+    bottom = MAX(bottom, y2);
+
+    if (left < 0) left = 0;
+    if (top < 0) top = 0;
+    if ((right < left) || (bottom < top))
+        return;
+
+    int32_t tile_left = left / TILE_SIZE;
+    int32_t tile_top = top / TILE_SIZE;
+    int32_t tile_right = right / TILE_SIZE;
+    int32_t tile_bottom = bottom / TILE_SIZE;
+    if (tile_right >= (int32_t)tiler->tiles_x)
+        tile_right = tiler->tiles_x - 1;
+    if (tile_bottom >= (int32_t)tiler->tiles_y)
+        tile_bottom = tiler->tiles_y - 1;
+    if ((tile_left > tile_right) || (tile_top > tile_bottom))
+        return;
+
+    uint32_t id = tiler->triangles.used_size;
+    ra_push(&tiler->triangles, tri);
+
+    for (int32_t ty = tile_top; ty <= tile_bottom; ty++) {
+        for (int32_t tx = tile_left; tx <= tile_right; tx++) {
+            ra_push(&tiler->bins[ty * tiler->tiles_x + tx], &id);
+        }
+    }
+}
+
+// Rasterize and shade all binned triangles, returns after all tiles are done
+void s3d_tiler_flush(S3D_CONTEXT *ctx) {
+    S3D_TILER *tiler = ctx->tiler;
+    if (tiler->triangles.used_size == 0)
+        return;
+
+    s3d_pool_run(ctx, s3d_tiler_render_tile, tiler,
+            tiler->tiles_x * tiler->tiles_y);
+
+    tiler->triangles.used_size = 0;
+}
@@ -0,0 +1,93 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Fast clear
+// Instead of writing the clear value into every pixel, clearing only marks
+// every TILE_SIZE x TILE_SIZE tile of the framebuffer as cleared, and records
+// the clear value. A tile is resolved (filled with the clear value) on the
+// first access to it, or when the color buffer is copied out. Tiles are the
+// same as the binning tiles, so with tiled rendering a tile is only ever
+// resolved by the worker that owns it.
+
+static uint32_t s3d_clear_tiles_x(FBO *fbo) {
+    return (fbo->width + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+uint32_t s3d_clear_flags_size(uint32_t width, uint32_t height) {
+    uint32_t tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    return tiles_x * tiles_y;
+}
+
+void s3d_clear_tiles(S3D_CONTEXT *ctx, FBO *fbo, uint8_t flags) {
+    uint8_t *tiles = &ctx->vram[fbo->clear_address];
+    uint32_t count = s3d_clear_flags_size(fbo->width, fbo->height);
+    for (uint32_t i = 0; i < count; i++)
+        tiles[i] |= flags;
+}
+
+// Fill the tile with clear values of the pending buffers selected by mask
+static void s3d_resolve_tile(S3D_CONTEXT *ctx, FBO *fbo, uint32_t tile,
+        uint8_t mask) {
+    uint8_t *flags = &ctx->vram[fbo->clear_address + tile];
+    uint32_t tiles_x = s3d_clear_tiles_x(fbo);
+    int32_t x0 = (tile % tiles_x) * TILE_SIZE;
+    int32_t y0 = (tile / tiles_x) * TILE_SIZE;
+    int32_t x1 = MIN(x0 + TILE_SIZE, (int32_t)fbo->width);
+    int32_t y1 = MIN(y0 + TILE_SIZE, (int32_t)fbo->height);
+
+    if (*flags & mask & CLEAR_COLOR) {
+        uint32_t *color = (uint32_t *)&ctx->vram[fbo->color_address];
+        for (int32_t y = y0; y < y1; y++)
+            for (int32_t x = x0; x < x1; x++)
+                color[s3d_pixel_index(fbo, x, y)] = fbo->clear_color;
+    }
+    if (*flags & mask & CLEAR_DEPTH) {
+        float *depth = (float *)&ctx->vram[fbo->depth_address];
+        for (int32_t y = y0; y < y1; y++)
+            for (int32_t x = x0; x < x1; x++)
+                depth[s3d_pixel_index(fbo, x, y)] = fbo->clear_depth;
+    }
+    *flags &= ~mask;
+}
+
+// Make sure the tile containing pixel at x, y holds valid data
+void s3d_resolve_pixel(S3D_CONTEXT *ctx, FBO *fbo, int32_t x, int32_t y) {
+    uint32_t tile = (y / TILE_SIZE) * s3d_clear_tiles_x(fbo) + x / TILE_SIZE;
+    if (ctx->vram[fbo->clear_address + tile])
+        s3d_resolve_tile(ctx, fbo, tile, CLEAR_COLOR | CLEAR_DEPTH);
+}
+
+void s3d_resolve_tiles(S3D_CONTEXT *ctx, FBO *fbo, uint8_t mask) {
+    uint8_t *tiles = &ctx->vram[fbo->clear_address];
+    uint32_t count = s3d_clear_flags_size(fbo->width, fbo->height);
+    for (uint32_t i = 0; i < count; i++) {
+        if (tiles[i] & mask)
+            s3d_resolve_tile(ctx, fbo, i, mask);
+    }
+}
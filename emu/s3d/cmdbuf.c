@@ -0,0 +1,328 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Command buffers and submission queue
+// Commands are recorded on the application thread, and executed in order by
+// a per-context GPU thread once submitted. The application can prepare the
+// next frame while the current one is being rendered. Every submission gets
+// a fence value, fences signal in submission order.
+
+typedef enum {
+    CMD_CLEAR_COLOR,
+    CMD_CLEAR_DEPTH,
+    CMD_BIND_TEXTURE,
+    CMD_BIND_SAMPLER,
+    CMD_UPDATE_UNIFORM,
+    CMD_USE_PROGRAM,
+    CMD_SET_VARYING_COUNT,
+    CMD_RENDER,
+    CMD_RENDER_COPY,
+    CMD_PRESENT
+} CMD_TYPE;
+
+typedef struct {
+    CMD_TYPE type;
+    union {
+        struct {
+            uint32_t tmu;
+            uint32_t tex_id;
+        } bind_texture;
+        struct {
+            uint32_t tmu;
+            uint32_t sampler_id;
+        } bind_sampler;
+        struct {
+            uint32_t index; // Byte offset into uniform data of the cmdbuf
+            uint32_t offset;
+            uint32_t size;
+        } update_uniform;
+        uint32_t program_id;
+        uint32_t varying_count;
+        uint32_t vao_id;
+        uint8_t *destination;
+        uint8_t **image;
+    };
+} CMD;
+
+struct S3D_CMDBUF {
+    RESIZABLE_ARRAY commands;
+    // Uniform data is copied at record time, only the updated bytes are kept
+    RESIZABLE_ARRAY uniforms;
+};
+
+struct S3D_QUEUE {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t submit_cond;
+    pthread_cond_t done_cond;
+    RESIZABLE_ARRAY pending; // Submitted command buffers
+    size_t head; // Next pending command buffer to execute
+    S3D_FENCE submitted;
+    S3D_FENCE completed;
+    bool exit;
+};
+
+S3D_CMDBUF *s3d_cmdbuf_create(void) {
+    S3D_CMDBUF *cmdbuf = calloc(1, sizeof(S3D_CMDBUF));
+    assert(cmdbuf);
+    ra_init(&cmdbuf->commands, sizeof(CMD));
+    ra_init(&cmdbuf->uniforms, sizeof(uint8_t));
+    return cmdbuf;
+}
+
+void s3d_cmdbuf_destroy(S3D_CMDBUF *cmdbuf) {
+    ra_deinit(&cmdbuf->commands);
+    ra_deinit(&cmdbuf->uniforms);
+    free(cmdbuf);
+}
+
+void s3d_cmdbuf_reset(S3D_CMDBUF *cmdbuf) {
+    cmdbuf->commands.used_size = 0;
+    cmdbuf->uniforms.used_size = 0;
+}
+
+void s3d_cmd_clear_color(S3D_CMDBUF *cmdbuf) {
+    CMD cmd = {.type = CMD_CLEAR_COLOR};
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_clear_depth(S3D_CMDBUF *cmdbuf) {
+    CMD cmd = {.type = CMD_CLEAR_DEPTH};
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_bind_texture(S3D_CMDBUF *cmdbuf, uint32_t tmu, uint32_t tex_id) {
+    assert(tmu < TMU_COUNT);
+    CMD cmd = {.type = CMD_BIND_TEXTURE};
+    cmd.bind_texture.tmu = tmu;
+    cmd.bind_texture.tex_id = tex_id;
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_bind_sampler(S3D_CMDBUF *cmdbuf, uint32_t tmu,
+        uint32_t sampler_id) {
+    assert(tmu < TMU_COUNT);
+    CMD cmd = {.type = CMD_BIND_SAMPLER};
+    cmd.bind_sampler.tmu = tmu;
+    cmd.bind_sampler.sampler_id = sampler_id;
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_update_uniform(S3D_CMDBUF *cmdbuf, void *buffer, size_t size) {
+    s3d_cmd_update_uniform_range(cmdbuf, 0, buffer, size);
+}
+
+void s3d_cmd_update_uniform_range(S3D_CMDBUF *cmdbuf, size_t offset,
+        void *buffer, size_t size) {
+    assert(offset + size <= UNIFORM_SIZE);
+    CMD cmd = {.type = CMD_UPDATE_UNIFORM};
+    cmd.update_uniform.index = cmdbuf->uniforms.used_size;
+    cmd.update_uniform.offset = offset;
+    cmd.update_uniform.size = size;
+    ra_push_array(&cmdbuf->uniforms, buffer, size);
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_use_program(S3D_CMDBUF *cmdbuf, uint32_t program_id) {
+    CMD cmd = {.type = CMD_USE_PROGRAM};
+    cmd.program_id = program_id;
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_set_varying_count(S3D_CMDBUF *cmdbuf, size_t count) {
+    CMD cmd = {.type = CMD_SET_VARYING_COUNT};
+    cmd.varying_count = count;
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_render(S3D_CMDBUF *cmdbuf, uint32_t vao_id) {
+    CMD cmd = {.type = CMD_RENDER};
+    cmd.vao_id = vao_id;
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_render_copy(S3D_CMDBUF *cmdbuf, uint8_t *destination) {
+    CMD cmd = {.type = CMD_RENDER_COPY};
+    cmd.destination = destination;
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+void s3d_cmd_present(S3D_CMDBUF *cmdbuf, uint8_t **image) {
+    CMD cmd = {.type = CMD_PRESENT};
+    cmd.image = image;
+    ra_push(&cmdbuf->commands, &cmd);
+}
+
+// Commands map 1:1 to the immediate API
+static void s3d_cmdbuf_execute(S3D_CONTEXT *ctx, S3D_CMDBUF *cmdbuf) {
+    CMD *commands = (CMD *)cmdbuf->commands.buf;
+    uint8_t *uniforms = (uint8_t *)cmdbuf->uniforms.buf;
+    for (size_t i = 0; i < cmdbuf->commands.used_size; i++) {
+        CMD *cmd = &commands[i];
+        switch (cmd->type) {
+        case CMD_CLEAR_COLOR:
+            s3d_clear_color(ctx);
+            break;
+        case CMD_CLEAR_DEPTH:
+            s3d_clear_depth(ctx);
+            break;
+        case CMD_BIND_TEXTURE:
+            s3d_bind_texture(ctx, cmd->bind_texture.tmu,
+                    cmd->bind_texture.tex_id);
+            break;
+        case CMD_BIND_SAMPLER:
+            s3d_bind_sampler(ctx, cmd->bind_sampler.tmu,
+                    cmd->bind_sampler.sampler_id);
+            break;
+        case CMD_UPDATE_UNIFORM:
+            s3d_update_uniform_range(ctx, cmd->update_uniform.offset,
+                    &uniforms[cmd->update_uniform.index],
+                    cmd->update_uniform.size);
+            break;
+        case CMD_USE_PROGRAM:
+            s3d_use_program(ctx, cmd->program_id);
+            break;
+        case CMD_SET_VARYING_COUNT:
+            s3d_set_varying_count(ctx, cmd->varying_count);
+            break;
+        case CMD_RENDER:
+            s3d_render(ctx, cmd->vao_id);
+            break;
+        case CMD_RENDER_COPY:
+            s3d_render_copy(ctx, cmd->destination);
+            break;
+        case CMD_PRESENT:
+            *cmd->image = s3d_present(ctx);
+            break;
+        }
+    }
+}
+
+static void *s3d_queue_thread(void *arg) {
+    S3D_CONTEXT *ctx = arg;
+    S3D_QUEUE *queue = ctx->queue;
+
+    s3d_trace_thread_name("s3d queue");
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while ((queue->head == queue->pending.used_size) && !queue->exit)
+            pthread_cond_wait(&queue->submit_cond, &queue->lock);
+        if (queue->head == queue->pending.used_size)
+            break; // Exit only once everything submitted is done
+        S3D_CMDBUF *cmdbuf = ((S3D_CMDBUF **)queue->pending.buf)[queue->head];
+        queue->head++;
+        pthread_mutex_unlock(&queue->lock);
+
+        uint64_t trace = s3d_trace_begin();
+        s3d_cmdbuf_execute(ctx, cmdbuf);
+        s3d_trace_end("cmdbuf", trace);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->completed++;
+        if (queue->head == queue->pending.used_size) {
+            queue->head = 0;
+            queue->pending.used_size = 0;
+        }
+        pthread_cond_broadcast(&queue->done_cond);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+void s3d_queue_init(S3D_CONTEXT *ctx) {
+    S3D_QUEUE *queue = calloc(1, sizeof(S3D_QUEUE));
+    assert(queue);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->submit_cond, NULL);
+    pthread_cond_init(&queue->done_cond, NULL);
+    ra_init(&queue->pending, sizeof(S3D_CMDBUF *));
+    ctx->queue = queue;
+}
+
+void s3d_queue_deinit(S3D_CONTEXT *ctx) {
+    S3D_QUEUE *queue = ctx->queue;
+    if (queue->running) {
+        pthread_mutex_lock(&queue->lock);
+        queue->exit = true;
+        pthread_cond_signal(&queue->submit_cond);
+        pthread_mutex_unlock(&queue->lock);
+        pthread_join(queue->thread, NULL);
+    }
+    ra_deinit(&queue->pending);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->submit_cond);
+    pthread_cond_destroy(&queue->done_cond);
+    free(queue);
+    ctx->queue = NULL;
+}
+
+S3D_FENCE s3d_submit(S3D_CONTEXT *ctx, S3D_CMDBUF *cmdbuf) {
+    S3D_QUEUE *queue = ctx->queue;
+    // GPU thread is only started once something is submitted
+    if (!queue->running) {
+        int result = pthread_create(&queue->thread, NULL, s3d_queue_thread,
+                ctx);
+        assert(result == 0);
+        queue->running = true;
+    }
+    pthread_mutex_lock(&queue->lock);
+    ra_push(&queue->pending, &cmdbuf);
+    S3D_FENCE fence = ++queue->submitted;
+    pthread_cond_signal(&queue->submit_cond);
+    pthread_mutex_unlock(&queue->lock);
+    return fence;
+}
+
+bool s3d_fence_signaled(S3D_CONTEXT *ctx, S3D_FENCE fence) {
+    S3D_QUEUE *queue = ctx->queue;
+    pthread_mutex_lock(&queue->lock);
+    bool signaled = queue->completed >= fence;
+    pthread_mutex_unlock(&queue->lock);
+    return signaled;
+}
+
+void s3d_wait_fence(S3D_CONTEXT *ctx, S3D_FENCE fence) {
+    S3D_QUEUE *queue = ctx->queue;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->completed < fence)
+        pthread_cond_wait(&queue->done_cond, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void s3d_wait_idle(S3D_CONTEXT *ctx) {
+    S3D_QUEUE *queue = ctx->queue;
+    pthread_mutex_lock(&queue->lock);
+    S3D_FENCE fence = queue->submitted;
+    pthread_mutex_unlock(&queue->lock);
+    s3d_wait_fence(ctx, fence);
+}
@@ -27,7 +27,6 @@
 #include "s3d.h"
 #include "utils.h"
 #include "s3d_private.h"
-#include "simple_shaders.h"
 
 static bool z_test(float *z_addr, float depth) {
     float old_z = *z_addr;
@@ -42,100 +41,213 @@ static bool z_test(float *z_addr, float depth) {
     return false;
 }
 
+// Evaluate a plane equation for all 4 pixels of the quad at x, y
+static void plane_eval_quad(PLANE *plane, float dx, float dy, float *result) {
+    float base = plane->a0 + plane->dadx * dx + plane->dady * dy;
+    result[0] = base;
+    result[1] = base + plane->dadx;
+    result[2] = base + plane->dady;
+    result[3] = result[2] + plane->dadx;
+}
+
+// Per quad statistics, counted locally and added once
+typedef struct {
+    uint32_t lanes;
+    uint32_t z_passed;
+    uint32_t z_killed;
+    uint32_t shaded;
+    uint32_t written;
+} QUAD_COUNTS;
+
+static void s3d_count_quad(S3D_CONTEXT *ctx, QUAD_COUNTS *counts) {
+    S3D_STATS *stats = &ctx->stats;
+    S3D_STAT_ADD(stats->quads_generated, 1);
+    S3D_STAT_ADD(stats->quad_lanes_active, counts->lanes);
+    S3D_STAT_ADD(stats->z_passed, counts->z_passed);
+    S3D_STAT_ADD(stats->z_killed, counts->z_killed);
+    S3D_STAT_ADD(stats->fragments_shaded, counts->shaded);
+    S3D_STAT_ADD(stats->rop_writes, counts->written);
+}
+
+// Depth test the pixels set in masks, clears masks of failed pixels
+static void s3d_depth_test_quad(S3D_CONTEXT *ctx, FBO *fbo, float *z_buffer,
+        bool *masks, int32_t *xx, int32_t *yy, float *frag_depth,
+        QUAD_COUNTS *counts) {
+    for (int i = 0; i < 4; i++) {
+        if (masks[i]) {
+            if (z_test(&z_buffer[s3d_pixel_index(fbo, xx[i], yy[i])], frag_depth[i])) {
+                s3d_hiz_mark(ctx, fbo, xx[i], yy[i]);
+                counts->z_passed++;
+            }
+            else {
+                masks[i] = false;
+                counts->z_killed++;
+            }
+        }
+    }
+}
+
+// Run the per pixel fragment shader on the lanes set in masks
+static inline __attribute__((always_inline)) void s3d_shade_pixels(
+        S3D_CONTEXT *ctx, bool *masks, SETUP_TRIANGLE *tri, float dx,
+        float dy, FS_LANES interpolated_w, const uint32_t varying_count,
+        const bool texture, VEC3 *frag_color, float *frag_depth,
+        QUAD_COUNTS *counts) {
+    float varying[4][MAX_VARYING];
+    for (uint32_t j = 0; j < varying_count; j++) {
+        float attr_over_w[4];
+        plane_eval_quad(&tri->varying[j], dx, dy, attr_over_w);
+        for (int i = 0; i < 4; i++) {
+            varying[i][j] = attr_over_w[i] * interpolated_w[i];
+        }
+    }
+
+    // Calculate partial derivative
+    // They are only used for texture LOD selection, so they are left zero
+    // when no texture is bound. Pixel i is on row i / 2 and column i % 2,
+    // ddx is per row and ddy is per column.
+    static float no_derivative[MAX_VARYING];
+    float ddx[2][MAX_VARYING];
+    float ddy[2][MAX_VARYING];
+    if (texture) {
+        for (uint32_t i = 0; i < varying_count; i++) {
+            ddx[0][i] = varying[1][i] - varying[0][i];
+            ddx[1][i] = varying[3][i] - varying[2][i];
+            ddy[0][i] = varying[2][i] - varying[0][i];
+            ddy[1][i] = varying[3][i] - varying[1][i];
+        }
+    }
+
+    S3D_FS fs = ctx->active_program.fs;
+
+    for (int i = 0; i < 4; i++) {
+        // TODO: pass masks to fs, allowing killing frag
+        if (masks[i]) {
+            fs(
+                ctx,
+                ctx->uniforms,
+                varying[i],
+                texture ? ddx[i / 2] : no_derivative,
+                texture ? ddy[i % 2] : no_derivative,
+                &frag_color[i],
+                &frag_depth[i]
+            );
+            counts->shaded++;
+        }
+    }
+}
+
+typedef enum {
+    QUAD_Z_EARLY,
+    QUAD_Z_LATE,
+    QUAD_Z_OFF
+} QUAD_Z_MODE;
+
 // Accept a group of pixels (2x2) and starts processing
-void s3d_process_fragments(bool* masks, int32_t x, int32_t y, int32_t *w0,
-        int32_t *w1, int32_t *w2, POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
-        POST_VS_VERTEX *v2) {
+// Always inlined into the kernels below, with everything but the context and
+// the quad being constant, so the branches on the pipeline state fold away
+// and the varying loops have a fixed trip count.
+static inline __attribute__((always_inline)) void s3d_quad_kernel(
+        S3D_CONTEXT *ctx, bool* masks, int32_t x, int32_t y,
+        SETUP_TRIANGLE *tri, const uint32_t varying_count,
+        const QUAD_Z_MODE z_mode, const bool shade, const bool texture) {
+    QUAD_COUNTS counts = {0};
     // Reminder: triangle order
     // 0 1 EDGE
     // 2 3 FUNC
     int32_t xx[4] = {x, x + 1, x, x + 1};
     int32_t yy[4] = {y, y, y + 1, y + 1};
 
-    FBO fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
-    float *z_buffer = (float *)&s3d_context.vram[fbo.depth_address];
+    FBO fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+    float *z_buffer = (float *)&ctx->vram[fbo.depth_address];
+
+    // Pixels outside of the framebuffer must not reach the depth buffer, as
+    // x == width would otherwise alias to the first pixel of the next line.
+    for (int i = 0; i < 4; i++) {
+        if ((xx[i] < 0) || (xx[i] >= (int32_t)fbo.width) ||
+                (yy[i] < 0) || (yy[i] >= (int32_t)fbo.height))
+            masks[i] = false;
+        counts.lanes += masks[i];
+    }
 
-#if 0
+    // Quads are aligned to 2 pixels, so they never straddle 2 tiles. Resolve
+    // pending fast clears of the tile before the depth buffer is accessed.
     for (int i = 0; i < 4; i++) {
         if (masks[i]) {
-            s3d_set_pixel(&fbo, xx[i], yy[i], 0xffffffff); 
+            s3d_resolve_pixel(ctx, &fbo, xx[i], yy[i]);
+            break;
         }
     }
-#else
+
+    // Quad position relative to the plane anchor
+    float dx = (float)(x - tri->x[0]);
+    float dy = (float)(y - tri->y[0]);
+
     // Run setup process serially. On hardware they are processed in parallel.
-    float interpolated_z_over_w[4];
     float frag_depth[4];
-    bool early_z = false;
-    for (int i = 0; i < 4; i++) {
-        interpolated_z_over_w[i] = (v0->position.z * w0[i] +
-                v1->position.z * w1[i] + v2->position.z * w2[i]) /
-                (w0[i] + w1[i] + w2[i]);
-        frag_depth[i] = interpolated_z_over_w[i];
-        if (s3d_context.early_depth_test && masks[i]) {
-            early_z |= z_test(&z_buffer[yy[i] * fbo.width + xx[i]], frag_depth[i]);
+    plane_eval_quad(&tri->z, dx, dy, frag_depth);
+    if (z_mode == QUAD_Z_EARLY) {
+        // Failed pixels are masked out, so they are neither shaded nor written,
+        // same as with late Z. The passing ones may still be used as helpers
+        // by a quad fragment shader
+        s3d_depth_test_quad(ctx, &fbo, z_buffer, masks, xx, yy, frag_depth,
+                &counts);
+
+        // If all pixels are rejected by early Z, reject the group.
+        if (!(masks[0] || masks[1] || masks[2] || masks[3])) {
+            if (ctx->stats_enabled)
+                s3d_count_quad(ctx, &counts);
+            return;
         }
     }
 
-    // Reject pixels
-    if (s3d_context.early_depth_test & !early_z) {
-        // If all pixels are rejected by early Z, reject the group.
+    // Depth only program, there is nothing to shade
+    if (!shade) {
+        if (z_mode == QUAD_Z_LATE)
+            s3d_depth_test_quad(ctx, &fbo, z_buffer, masks, xx, yy,
+                    frag_depth, &counts);
+        if (ctx->stats_enabled)
+            s3d_count_quad(ctx, &counts);
         return;
     }
 
     // Interpolate varyings
     // Interpolation should not be masked as they are still used for partial derivative
-    float varying[4][s3d_context.varying_count];
-    for (int i = 0; i < 4; i++) {
-        VEC3 w_inverse = {v0->position.w, v1->position.w, v2->position.w};
-        VEC3 baricentric_coord = {(float)w0[i], (float)w1[i], (float)w2[i]};
-        float interpolated_w_inverse = 1.0f / vec3_dot(w_inverse, baricentric_coord);
-    
-        for (uint32_t j = 0; j < s3d_context.varying_count; j++) {
-            //printf("Interpolating varying %d\n", i);
-            VEC3 attr_over_w = {v0->varying[j], v1->varying[j], v2->varying[j]};
-            //print_vec3(attr_over_w, "Attributions");
-            float interpolated_attr_over_w = vec3_dot(attr_over_w, baricentric_coord);
-            varying[i][j] = interpolated_attr_over_w * interpolated_w_inverse;
-        }
-    }
-
-    // Calculate partial derivative
-    float ddx[2][s3d_context.varying_count];
-    float ddy[2][s3d_context.varying_count];
-    // Question: how does this part parallelize?
-    // Probably only calculate when needed (like, texture mapping.)
-    for (uint32_t i = 0; i < s3d_context.varying_count; i++) {
-        ddx[0][i] = varying[1][i] - varying[0][i];
-        ddx[1][i] = varying[3][i] - varying[2][i];
-        ddy[0][i] = varying[2][i] - varying[0][i];
-        ddy[1][i] = varying[3][i] - varying[1][i];
-    }
+    FS_LANES interpolated_w;
+    plane_eval_quad(&tri->w_inverse, dx, dy, (float *)&interpolated_w);
+    interpolated_w = 1.0f / interpolated_w;
 
     VEC3 frag_color[4];
-
-    for (int i = 0; i < 4; i++) {
-        // TODO: pass masks to simple_fs, allowing killing frag
-        if (masks[i]) {
-            simple_fs(
-                s3d_context.uniforms,
-                varying[i],
-                ddx[i % 2],
-                ddy[i / 2],
-                &frag_color[i],
-                &frag_depth[i]
-            );
+    S3D_FS_QUAD fs_quad = ctx->active_program.fs_quad;
+    if (fs_quad) {
+        // All 4 lanes are shaded at once, the shader takes derivatives
+        // between lanes itself
+        FS_LANES varying[MAX_VARYING];
+        for (uint32_t j = 0; j < varying_count; j++) {
+            plane_eval_quad(&tri->varying[j], dx, dy, (float *)&varying[j]);
+            varying[j] *= interpolated_w;
         }
-    }
-
-    // Late Z (if early Z is not enabled)
-    if (!s3d_context.early_depth_test) {
+        FS_LANES color[3];
+        FS_LANES depth;
+        for (int i = 0; i < 4; i++)
+            depth[i] = frag_depth[i];
+        fs_quad(ctx, ctx->uniforms, masks, varying, color, &depth);
         for (int i = 0; i < 4; i++) {
-            if (masks[i]) {
-                if (!z_test(&z_buffer[yy[i] * fbo.width + xx[i]], frag_depth[i]))
-                    masks[i] = false;
-            }
+            frag_color[i].x = color[0][i];
+            frag_color[i].y = color[1][i];
+            frag_color[i].z = color[2][i];
+            frag_depth[i] = depth[i];
+            counts.shaded += masks[i];
         }
     }
+    else {
+        s3d_shade_pixels(ctx, masks, tri, dx, dy, interpolated_w,
+                varying_count, texture, frag_color, frag_depth, &counts);
+    }
+
+    if (z_mode == QUAD_Z_LATE)
+        s3d_depth_test_quad(ctx, &fbo, z_buffer, masks, xx, yy, frag_depth,
+                &counts);
 
     // ROP
     for (int i = 0; i < 4; i++) {
@@ -153,8 +265,100 @@ void s3d_process_fragments(bool* masks, int32_t x, int32_t y, int32_t *w0,
             if (g < 0) g = 0;
             if (b < 0) b = 0;
             uint32_t color = s3d_map_rgb(r, g, b);
-            s3d_set_pixel(&fbo, xx[i], yy[i], color); 
+            s3d_set_pixel(ctx, &fbo, xx[i], yy[i], color); 
+            counts.written++;
         }
     }
-#endif
-}
\ No newline at end of file
+    if (ctx->stats_enabled)
+        s3d_count_quad(ctx, &counts);
+}
+
+// Pre-instantiated kernels, for every Z mode, with and without texture, and
+// varying counts up to SPECIALIZED_VARYING. Larger varying counts use the
+// kernels reading the count from the context.
+#define SPECIALIZED_VARYING (8)
+
+#define QUAD_KERNEL(name, varyings, z_mode, shade, texture) \
+    static void name(S3D_CONTEXT *ctx, bool *masks, int32_t x, int32_t y, \
+            SETUP_TRIANGLE *tri) { \
+        s3d_quad_kernel(ctx, masks, x, y, tri, varyings, z_mode, shade, \
+                texture); \
+    }
+
+#define QUAD_KERNEL_SHADED(n, varyings, z) \
+    QUAD_KERNEL(s3d_quad_##z##_##n, varyings, QUAD_Z_##z, true, false) \
+    QUAD_KERNEL(s3d_quad_##z##_##n##_tex, varyings, QUAD_Z_##z, true, true)
+
+#define QUAD_KERNEL_Z(z) \
+    QUAD_KERNEL(s3d_quad_##z##_depth, 0, QUAD_Z_##z, false, false) \
+    QUAD_KERNEL_SHADED(0, 0, z) \
+    QUAD_KERNEL_SHADED(1, 1, z) \
+    QUAD_KERNEL_SHADED(2, 2, z) \
+    QUAD_KERNEL_SHADED(3, 3, z) \
+    QUAD_KERNEL_SHADED(4, 4, z) \
+    QUAD_KERNEL_SHADED(5, 5, z) \
+    QUAD_KERNEL_SHADED(6, 6, z) \
+    QUAD_KERNEL_SHADED(7, 7, z) \
+    QUAD_KERNEL_SHADED(8, 8, z) \
+    QUAD_KERNEL_SHADED(n, ctx->varying_count, z)
+
+QUAD_KERNEL_Z(EARLY)
+QUAD_KERNEL_Z(LATE)
+QUAD_KERNEL_Z(OFF)
+
+#define QUAD_KERNEL_ROW(z, suffix) { \
+    s3d_quad_##z##_0##suffix, s3d_quad_##z##_1##suffix, \
+    s3d_quad_##z##_2##suffix, s3d_quad_##z##_3##suffix, \
+    s3d_quad_##z##_4##suffix, s3d_quad_##z##_5##suffix, \
+    s3d_quad_##z##_6##suffix, s3d_quad_##z##_7##suffix, \
+    s3d_quad_##z##_8##suffix, s3d_quad_##z##_n##suffix }
+
+#define QUAD_KERNEL_TABLE(z) { QUAD_KERNEL_ROW(z, ), QUAD_KERNEL_ROW(z, _tex) }
+
+// Indexed by Z mode, texture, varying count
+static const QUAD_KERNEL quad_kernels[3][2][SPECIALIZED_VARYING + 2] = {
+    QUAD_KERNEL_TABLE(EARLY),
+    QUAD_KERNEL_TABLE(LATE),
+    QUAD_KERNEL_TABLE(OFF)
+};
+
+static const QUAD_KERNEL depth_kernels[3] = {
+    s3d_quad_EARLY_depth,
+    s3d_quad_LATE_depth,
+    s3d_quad_OFF_depth
+};
+
+// Pick the kernel for the bound state, called at the start of every draw
+void s3d_select_quad_kernel(S3D_CONTEXT *ctx) {
+    QUAD_Z_MODE z_mode;
+    if (!ctx->depth_test)
+        z_mode = QUAD_Z_OFF;
+    else if (ctx->early_depth_test)
+        z_mode = QUAD_Z_EARLY;
+    else
+        z_mode = QUAD_Z_LATE;
+
+    if (!ctx->active_program.fs) {
+        ctx->quad_kernel = depth_kernels[z_mode];
+        return;
+    }
+
+    uint32_t varying = ctx->varying_count;
+    if (varying > SPECIALIZED_VARYING)
+        varying = SPECIALIZED_VARYING + 1;
+    ctx->quad_kernel = quad_kernels[z_mode][ctx->tmu[0].enabled][varying];
+}
+
+void s3d_process_fragments(S3D_CONTEXT *ctx, bool* masks, int32_t x,
+        int32_t y, SETUP_TRIANGLE *tri) {
+    uint64_t trace = s3d_trace_span_begin(S3D_TRACE_QUADS);
+    if (!ctx->stage_timing) {
+        ctx->quad_kernel(ctx, masks, x, y, tri);
+    }
+    else {
+        uint64_t start = s3d_timestamp();
+        ctx->quad_kernel(ctx, masks, x, y, tri);
+        S3D_STAT_ADD(ctx->stage_time.fsg, s3d_timestamp() - start);
+    }
+    s3d_trace_end("shade", trace);
+}
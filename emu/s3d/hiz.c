@@ -0,0 +1,119 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <math.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Hierarchical Z
+// Every HIZ_TILE_SIZE x HIZ_TILE_SIZE tile of the depth buffer keeps the
+// farthest depth within the tile. With the LESS depth test, a group of pixels
+// that is not nearer than the farthest depth of all tiles it covers would be
+// rejected anyway, so it can be skipped before interpolation and shading.
+// Depth writes only make the depth buffer nearer, so the stored value stays a
+// valid upper bound. Written tiles are marked dirty, and only recomputed when
+// the stale value is not enough to reject.
+// With tiled rendering, a HiZ tile is always owned by a single worker.
+
+// Margin for different rounding between the depth bound and the fragments
+#define HIZ_EPSILON (1e-5f)
+
+static HIZ_TILE *s3d_hiz_tiles(S3D_CONTEXT *ctx, FBO *fbo) {
+    return (HIZ_TILE *)&ctx->vram[fbo->hiz_address];
+}
+
+static uint32_t s3d_hiz_tiles_x(FBO *fbo) {
+    return (fbo->width + HIZ_TILE_SIZE - 1) / HIZ_TILE_SIZE;
+}
+
+uint32_t s3d_hiz_size(uint32_t width, uint32_t height) {
+    uint32_t tiles_x = (width + HIZ_TILE_SIZE - 1) / HIZ_TILE_SIZE;
+    uint32_t tiles_y = (height + HIZ_TILE_SIZE - 1) / HIZ_TILE_SIZE;
+    return tiles_x * tiles_y * sizeof(HIZ_TILE);
+}
+
+void s3d_hiz_clear(S3D_CONTEXT *ctx, FBO *fbo, float depth) {
+    HIZ_TILE *tiles = s3d_hiz_tiles(ctx, fbo);
+    uint32_t count = s3d_hiz_size(fbo->width, fbo->height) / sizeof(HIZ_TILE);
+    for (uint32_t i = 0; i < count; i++) {
+        tiles[i].max_depth = depth;
+        tiles[i].dirty = false;
+    }
+}
+
+void s3d_hiz_mark(S3D_CONTEXT *ctx, FBO *fbo, int32_t x, int32_t y) {
+    HIZ_TILE *tiles = s3d_hiz_tiles(ctx, fbo);
+    uint32_t tiles_x = s3d_hiz_tiles_x(fbo);
+    tiles[(y / HIZ_TILE_SIZE) * tiles_x + (x / HIZ_TILE_SIZE)].dirty = true;
+}
+
+// Recompute farthest depth of a tile from the depth buffer
+static void s3d_hiz_update(S3D_CONTEXT *ctx, FBO *fbo, HIZ_TILE *tile,
+        int32_t tx, int32_t ty) {
+    float *z_buffer = (float *)&ctx->vram[fbo->depth_address];
+    int32_t x0 = tx * HIZ_TILE_SIZE;
+    int32_t y0 = ty * HIZ_TILE_SIZE;
+    int32_t x1 = MIN(x0 + HIZ_TILE_SIZE, (int32_t)fbo->width);
+    int32_t y1 = MIN(y0 + HIZ_TILE_SIZE, (int32_t)fbo->height);
+    float max_depth = -INFINITY;
+    for (int32_t y = y0; y < y1; y++) {
+        for (int32_t x = x0; x < x1; x++)
+            max_depth = fmaxf(max_depth, z_buffer[s3d_pixel_index(fbo, x, y)]);
+    }
+    tile->max_depth = max_depth;
+    tile->dirty = false;
+}
+
+// Check if all pixels within the rect (inclusive) with depth no nearer than
+// min_depth would fail the depth test.
+bool s3d_hiz_reject(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0,
+        int32_t x1, int32_t y1, float min_depth) {
+    if (!ctx->depth_test || !ctx->hiz)
+        return false;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= (int32_t)fbo->width) x1 = fbo->width - 1;
+    if (y1 >= (int32_t)fbo->height) y1 = fbo->height - 1;
+    if ((x0 > x1) || (y0 > y1))
+        return true; // Nothing would be written anyway
+
+    min_depth -= HIZ_EPSILON;
+    HIZ_TILE *tiles = s3d_hiz_tiles(ctx, fbo);
+    uint32_t tiles_x = s3d_hiz_tiles_x(fbo);
+    for (int32_t ty = y0 / HIZ_TILE_SIZE; ty <= y1 / HIZ_TILE_SIZE; ty++) {
+        for (int32_t tx = x0 / HIZ_TILE_SIZE; tx <= x1 / HIZ_TILE_SIZE; tx++) {
+            HIZ_TILE *tile = &tiles[ty * tiles_x + tx];
+            if (min_depth >= tile->max_depth)
+                continue;
+            if (!tile->dirty)
+                return false;
+            s3d_hiz_update(ctx, fbo, tile, tx, ty);
+            if (min_depth < tile->max_depth)
+                return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,177 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Worker pool
+// Runs a job for a range of indices on worker_count workers of the context.
+// The calling thread always participates, so N workers means N - 1 threads.
+// Every context has its own pool.
+
+struct S3D_POOL {
+    pthread_t threads[MAX_WORKERS];
+    uint32_t thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    uint32_t generation;
+    uint32_t busy_workers;
+    uint32_t started_workers; // For handing out worker IDs
+    bool exit;
+
+    // Current job
+    POOL_JOB job;
+    void *arg;
+    uint32_t count;
+    uint32_t next;
+};
+
+// Grab indices until there are none left
+static void s3d_pool_run_job(S3D_POOL *pool) {
+    while (1) {
+        uint32_t index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (index >= pool->count)
+            break;
+        pool->job(pool->arg, index);
+    }
+}
+
+static __thread uint32_t worker_id;
+
+uint32_t s3d_worker_id(void) {
+    return worker_id;
+}
+
+static void *s3d_pool_worker(void *arg) {
+    S3D_POOL *pool = arg;
+    uint32_t generation = 0;
+
+    worker_id = __atomic_add_fetch(&pool->started_workers, 1,
+            __ATOMIC_RELAXED);
+
+    s3d_trace_thread_name("s3d worker");
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while ((pool->generation == generation) && !pool->exit)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->exit)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        s3d_pool_run_job(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->busy_workers--;
+        if (pool->busy_workers == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void s3d_pool_stop_workers(S3D_POOL *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->exit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pool->thread_count = 0;
+    pool->exit = false;
+}
+
+// (Re)create threads if the requested worker count changed
+static void s3d_pool_start_workers(S3D_POOL *pool, uint32_t worker_count) {
+    uint32_t thread_count = worker_count - 1;
+    if (thread_count == pool->thread_count)
+        return;
+    s3d_pool_stop_workers(pool);
+    pool->started_workers = 0;
+    for (uint32_t i = 0; i < thread_count; i++) {
+        int result = pthread_create(&pool->threads[i], NULL,
+                s3d_pool_worker, pool);
+        assert(result == 0);
+    }
+    pool->thread_count = thread_count;
+}
+
+void s3d_pool_init(S3D_CONTEXT *ctx) {
+    S3D_POOL *pool = calloc(1, sizeof(S3D_POOL));
+    assert(pool);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ctx->pool = pool;
+}
+
+void s3d_pool_deinit(S3D_CONTEXT *ctx) {
+    S3D_POOL *pool = ctx->pool;
+    s3d_pool_stop_workers(pool);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool);
+    ctx->pool = NULL;
+}
+
+// Run job(arg, i) for every i in [0, count), returns after all are done
+void s3d_pool_run(S3D_CONTEXT *ctx, POOL_JOB job, void *arg, uint32_t count) {
+    S3D_POOL *pool = ctx->pool;
+
+    pool->job = job;
+    pool->arg = arg;
+    pool->count = count;
+    pool->next = 0;
+
+    // Not worth waking up anyone
+    if (count <= 1) {
+        s3d_pool_run_job(pool);
+        return;
+    }
+
+    s3d_pool_start_workers(pool, ctx->worker_count);
+
+    if (pool->thread_count != 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy_workers = pool->thread_count;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    s3d_pool_run_job(pool);
+
+    if (pool->thread_count != 0) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy_workers != 0)
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
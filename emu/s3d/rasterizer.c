@@ -74,8 +74,16 @@ const char *cond_names[] = {
 
 
 // QUESTION: How do I find right edge and apply bias?
-void s3d_rasterize_triangle(POST_VS_VERTEX *v0, 
-        POST_VS_VERTEX *v1, POST_VS_VERTEX *v2) {
+// If rect is not NULL, the walk is clamped to the rectangle and only quads
+// within it are emitted.
+// The walk decides where to go with a conservative test: whether the 2x2
+// pixel step of the quad (its pixels and the gap to the next quad) overlaps
+// the triangle at all. On every row pair these quads form one span, and the
+// spans of neighbouring rows overlap, so the walk visits every quad with a
+// covered pixel wherever it starts. Quads emitted do not depend on rect, apart
+// from the ones outside of it.
+static void s3d_rasterize_triangle_fsm(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri,
+        S3D_RECT *rect) {
     // Rasterizer takes 2D coordinates as input
     // Generate fragments (with 2D coordinates)
     // How about let it run at a rate of ... 2 pixel per clock?
@@ -86,20 +94,20 @@ void s3d_rasterize_triangle(POST_VS_VERTEX *v0,
     RAS_COND cond;
 
     // DEBUG
-    FBO fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
+    FBO fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
 
-    int32_t x0 = v0->screen_position[0];
-    int32_t y0 = v0->screen_position[1];
-    int32_t x1 = v1->screen_position[0];
-    int32_t y1 = v1->screen_position[1];
-    int32_t x2 = v2->screen_position[0];
-    int32_t y2 = v2->screen_position[1];
+    int32_t x0 = tri->x[0];
+    int32_t y0 = tri->y[0];
+    int32_t x1 = tri->x[1];
+    int32_t y1 = tri->y[1];
+    int32_t x2 = tri->x[2];
+    int32_t y2 = tri->y[2];
 
     // Triangle setup
     // TODO: move these out of the function.
     int32_t step0_x, step0_y, step1_x, step1_y, step2_x, step2_y;
     int32_t left_edge, right_edge, upper_edge, lower_edge;
-    int32_t edge0[4], edge1[4], edge2[4];
+    int32_t edge0, edge1, edge2;
     int32_t x, y;
 
     // If it's not even an triangle...
@@ -112,8 +120,8 @@ void s3d_rasterize_triangle(POST_VS_VERTEX *v0,
     // Create the edge function of 0 and 1:
     step1_x = y0 - y1;
     step1_y = x1 - x0;
-    edge1[0] = (x2 - x1) * step1_x + (y2 - y1) * step1_y;
-    if (edge1[0] <= 0) {
+    edge1 = (x2 - x1) * step1_x + (y2 - y1) * step1_y;
+    if (edge1 <= 0) {
         /*swap(&x1, &x2);
         swap(&y1, &y2);
         printf("Reversing...\n");*/
@@ -140,10 +148,81 @@ void s3d_rasterize_triangle(POST_VS_VERTEX *v0,
     step2_x = y1 - y2;
     step2_y = x2 - x1;
 
+    int32_t step_x[3] = {step0_x, step1_x, step2_x};
+    int32_t step_y[3] = {step0_y, step1_y, step2_y};
+
     //printf("Step 0: %d, %d\n", step0_x, step0_y);
     //printf("Step 1: %d, %d\n", step1_x, step1_y);
     //printf("Step 2: %d, %d\n", step2_x, step2_y);
 
+    // Exact bounding box, for the conservative quad test
+    int32_t min_x = MIN(x0, x1);
+    min_x = MIN(min_x, x2);
+    int32_t max_x = MAX(x0, x1);
+    max_x = MAX(max_x, x2);
+    int32_t min_y = MIN(y0, y1);
+    min_y = MIN(min_y, y2);
+    int32_t max_y = MAX(y0, y1);
+    max_y = MAX(max_y, y2);
+
+    // Only walk the part of the bounding box within the scissor rectangle.
+    // The left and right edge stay 1 quad outside of the walked area.
+    if (rect) {
+        int32_t rect_left = rect->x0 - 2;
+        int32_t rect_right = (rect->x1 + 1) / 2 * 2;
+        int32_t rect_lower = (rect->y1 + 1) / 2 * 2;
+        if (left_edge < rect_left)
+            left_edge = rect_left;
+        if (right_edge > rect_right)
+            right_edge = rect_right;
+        if (upper_edge < rect->y0)
+            upper_edge = rect->y0;
+        if (lower_edge > rect_lower)
+            lower_edge = rect_lower;
+        if ((left_edge + 2 >= right_edge) || (upper_edge >= lower_edge))
+            return;
+    }
+
+    // Largest increase of each edge function over a 2x2 quad step
+    int32_t reach[3];
+    for (int i = 0; i < 3; i++) {
+        int32_t reach_x = MAX(step_x[i] * 2, 0);
+        int32_t reach_y = MAX(step_y[i] * 2, 0);
+        reach[i] = reach_x + reach_y;
+    }
+
+    // Compare the rectangle against every edge. If all of its corners are
+    // outside of one edge, there is nothing to walk. If all of them are
+    // inside of every edge, the rectangle is entirely inside of the convex
+    // triangle, and needs no walk either.
+    if (rect) {
+        int32_t corner_x[4] = {rect->x0, rect->x1 - 1, rect->x0, rect->x1 - 1};
+        int32_t corner_y[4] = {rect->y0, rect->y0, rect->y1 - 1, rect->y1 - 1};
+        bool rect_inside = true;
+        for (int e = 0; e < 3; e++) {
+            int corners_inside = 0;
+            for (int i = 0; i < 4; i++) {
+                int32_t value = (corner_x[i] - tri->x[e]) * step_x[e] +
+                        (corner_y[i] - tri->y[e]) * step_y[e];
+                corners_inside += (value >= 0);
+            }
+            if (corners_inside == 0)
+                return;
+            if (corners_inside != 4)
+                rect_inside = false;
+        }
+        if (rect_inside) {
+            for (y = rect->y0; y < rect->y1; y += 2) {
+                for (x = rect->x0; x < rect->x1; x += 2) {
+                    // The quad kernel clears masks, so start over every quad
+                    bool inside[4] = {true, true, true, true};
+                    s3d_process_fragments(ctx, inside, x, y, tri);
+                }
+            }
+            return;
+        }
+    }
+
     x = left_edge;
     y = upper_edge;
 
@@ -184,35 +263,33 @@ void s3d_rasterize_triangle(POST_VS_VERTEX *v0,
     // For 640*480: 640*640+480*480= 640000
     // For 4096*4096: 4K^2 * 2 = 32M
     // uint32_t should be more than sufficient.
-    edge0[0] = (x - x0) * step0_x + (y - y0) * step0_y;
-    edge1[0] = (x - x1) * step1_x + (y - y1) * step1_y;
-    edge2[0] = (x - x2) * step2_x + (y - y2) * step2_y;
+    edge0 = (x - x0) * step0_x + (y - y0) * step0_y;
+    edge1 = (x - x1) * step1_x + (y - y1) * step1_y;
+    edge2 = (x - x2) * step2_x + (y - y2) * step2_y;
     // 0 1 EDGE
     // 2 3 FUNC
 
     uint32_t loop_counter = 0;
 
     while (rasterizer_active) {
-        // Update additional edge funcs
-        // TODO: Optimize for hardware
-        edge0[1] = edge0[0] + step0_x;
-        edge1[1] = edge1[0] + step1_x;
-        edge2[1] = edge2[0] + step2_x;
-        edge0[2] = edge0[0] + step0_y;
-        edge1[2] = edge1[0] + step1_y;
-        edge2[2] = edge2[0] + step2_y;
-        edge0[3] = edge0[2] + step0_x;
-        edge1[3] = edge1[2] + step1_x;
-        edge2[3] = edge2[2] + step2_x;
-
         // Evaluate edge functions
+        int32_t edge[3] = {edge0, edge1, edge2};
+        uint32_t coverage = s3d_coverage_quad(edge, step_x, step_y);
         bool inside[4];
         for (int i = 0; i < 4; i++) {
-            inside[i] = ((edge0[i] >= 0) && (edge1[i] >= 0) && (edge2[i] >= 0));
+            inside[i] = (coverage >> i) & 1;
         }
-        bool any_inside = inside[0] | inside[1] | inside[2] | inside[3];
+        bool any_inside = (coverage != 0);
 
-        if (any_inside)
+        // Separating axis test of the quad step against the triangle, the
+        // left and right edge are never inside
+        bool overlap = (x > left_edge) && (x < right_edge) &&
+                (x <= max_x) && (x + 2 >= min_x) &&
+                (y <= max_y) && (y + 2 >= min_y) &&
+                (edge0 + reach[0] >= 0) && (edge1 + reach[1] >= 0) &&
+                (edge2 + reach[2] >= 0);
+
+        if (overlap)
             cond = COND_INSIDE;
         else if (x == left_edge)
             cond = COND_LEFT_EDGE;
@@ -303,38 +380,276 @@ void s3d_rasterize_triangle(POST_VS_VERTEX *v0,
         s3d_set_pixel(&fbo, x, y, color);
 #endif
 
+        // Discard quads outside of the scissor rectangle
+        if (rect && ((x < rect->x0) || (x >= rect->x1) || (y < rect->y0)))
+            pixel_valid = false;
+
         // Processed pixel:
         if (any_inside && pixel_valid) {
             //s3d_set_pixel(&fbo, x, y, 0xffffffff);
             //printf("Valid pixel %d %d %d %d %d\n", x, y, edge0, edge1, edge2);
             //s3d_process_fragment(x, y, edge2, edge0, edge1, v0, v1, v2);
-            s3d_process_fragments(inside, x, y, edge2, edge0, edge1, v0, v1, v2);
+            s3d_process_fragments(ctx, inside, x, y, tri);
         }
 
         // Stepping based on the direction
         switch (step_dir) {
-        case STEP_DOWN:  edge0[0] += step0_y * 2; edge1[0] += step1_y * 2; edge2[0] += step2_y * 2; y += 2; break;
-        case STEP_LEFT:  edge0[0] -= step0_x * 2; edge1[0] -= step1_x * 2; edge2[0] -= step2_x * 2; x -= 2; break;
-        case STEP_RIGHT: edge0[0] += step0_x * 2; edge1[0] += step1_x * 2; edge2[0] += step2_x * 2; x += 2; break;
+        case STEP_DOWN:  edge0 += step0_y * 2; edge1 += step1_y * 2; edge2 += step2_y * 2; y += 2; break;
+        case STEP_LEFT:  edge0 -= step0_x * 2; edge1 -= step1_x * 2; edge2 -= step2_x * 2; x -= 2; break;
+        case STEP_RIGHT: edge0 += step0_x * 2; edge1 += step1_x * 2; edge2 += step2_x * 2; x += 2; break;
         default: break; // Ignore step_none
         }
 
         // Exit
         if (y == lower_edge)
             rasterizer_active = false;
+        if (rect && (y >= rect->y1))
+            rasterizer_active = false;
 
         state = next_state;
 
         loop_counter++;
         if (loop_counter > 640*480) {
             printf("Infinite loop detected!\n");
-            print_vec4(v0->position, "V0 position");
-            print_vec4(v1->position, "V1 position");
-            print_vec4(v2->position, "V2 position");
+            printf("V0 %d, %d\n", x0, y0);
+            printf("V1 %d, %d\n", x1, y1);
+            printf("V2 %d, %d\n", x2, y2);
             return;
         }
     }
 #endif
 
     //printf("Rasterization done.\n");
-}
\ No newline at end of file
+}
+
+// Hierarchical block rasterizer
+// The bounding box is split into BLOCK_SIZE x BLOCK_SIZE blocks. Each block
+// is tested against the 3 edge functions using its corners: blocks fully
+// outside of any edge are skipped, blocks fully inside all edges have all
+// their quads emitted without per-pixel tests, and only the blocks crossing
+// an edge are subdivided, down to 4x4 pixels evaluated by coverage kernels.
+// Blocks of at least HIZ_TILE_SIZE are also tested against hierarchical Z.
+typedef struct {
+    S3D_CONTEXT *ctx;
+    SETUP_TRIANGLE *setup;
+    FBO *fbo;
+    int32_t x[3];
+    int32_t y[3];
+    int32_t step_x[3];
+    int32_t step_y[3];
+    float min_depth; // Nearest depth of the triangle
+} RAS_TRIANGLE;
+
+static int32_t ras_edge(RAS_TRIANGLE *tri, int e, int32_t x, int32_t y) {
+    return (x - tri->x[e]) * tri->step_x[e] + (y - tri->y[e]) * tri->step_y[e];
+}
+
+// Emit a quad with given coverage mask
+static void ras_emit_quad(RAS_TRIANGLE *tri, int32_t x, int32_t y,
+        uint32_t coverage) {
+    bool inside[4];
+
+    if (coverage == 0)
+        return;
+
+    for (int i = 0; i < 4; i++) {
+        inside[i] = (coverage >> i) & 1;
+    }
+    s3d_process_fragments(tri->ctx, inside, x, y, tri->setup);
+}
+
+static void ras_block(RAS_TRIANGLE *tri, int32_t x, int32_t y, int32_t size) {
+    bool accept = true;
+    int32_t last = size - 1;
+
+    for (int e = 0; e < 3; e++) {
+        // Edge functions are linear, so the extremes are on the corners
+        int32_t base = ras_edge(tri, e, x, y);
+        int32_t dx = tri->step_x[e] * last;
+        int32_t dy = tri->step_y[e] * last;
+        int32_t min = base + ((dx < 0) ? dx : 0) + ((dy < 0) ? dy : 0);
+        int32_t max = base + ((dx > 0) ? dx : 0) + ((dy > 0) ? dy : 0);
+        if (max < 0)
+            return; // Trivial reject
+        if (min < 0)
+            accept = false;
+    }
+
+    if (size >= HIZ_TILE_SIZE) {
+        // Depth is linear as well, nearest one of the block is on a corner
+        PLANE *z = &tri->setup->z;
+        float base = z->a0 + z->dadx * (x - tri->x[0]) +
+                z->dady * (y - tri->y[0]);
+        float dx = z->dadx * last;
+        float dy = z->dady * last;
+        float min_depth = base + fminf(dx, 0.0f) + fminf(dy, 0.0f);
+        min_depth = fmaxf(min_depth, tri->min_depth);
+        if (s3d_hiz_reject(tri->ctx, tri->fbo, x, y, x + last, y + last,
+                min_depth)) {
+            __atomic_fetch_add(&tri->ctx->hiz_stats.blocks_rejected, 1,
+                    __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    if (accept) {
+        for (int32_t qy = y; qy < y + size; qy += 2)
+            for (int32_t qx = x; qx < x + size; qx += 2)
+                ras_emit_quad(tri, qx, qy, 0xf);
+    }
+    else if (size == 4) {
+        // Test 4x2 pixels at a time
+        for (int32_t qy = y; qy < y + size; qy += 2) {
+            int32_t edge[3];
+            for (int e = 0; e < 3; e++)
+                edge[e] = ras_edge(tri, e, x, qy);
+            uint32_t coverage = s3d_coverage_4x2(edge, tri->step_x,
+                    tri->step_y);
+            ras_emit_quad(tri, x, qy, coverage & 0xf);
+            ras_emit_quad(tri, x + 2, qy, coverage >> 4);
+        }
+    }
+    else {
+        int32_t half = size / 2;
+        ras_block(tri, x, y, half);
+        ras_block(tri, x + half, y, half);
+        ras_block(tri, x, y + half, half);
+        ras_block(tri, x + half, y + half, half);
+    }
+}
+
+static void s3d_rasterize_triangle_block(S3D_CONTEXT *ctx,
+        SETUP_TRIANGLE *setup, S3D_RECT *rect, float min_depth) {
+    RAS_TRIANGLE tri;
+    S3D_RECT bound;
+    FBO fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+
+    tri.ctx = ctx;
+    tri.setup = setup;
+    tri.fbo = &fbo;
+    tri.min_depth = min_depth;
+    for (int i = 0; i < 3; i++) {
+        tri.x[i] = setup->x[i];
+        tri.y[i] = setup->y[i];
+    }
+
+    // Same rejection rules as the FSM
+    if ((tri.x[0] == tri.x[1]) && (tri.x[1] == tri.x[2]))
+        return;
+    if ((tri.y[0] == tri.y[1]) && (tri.y[1] == tri.y[2]))
+        return;
+
+    tri.step_x[0] = tri.y[2] - tri.y[0];
+    tri.step_y[0] = tri.x[0] - tri.x[2];
+    tri.step_x[1] = tri.y[0] - tri.y[1];
+    tri.step_y[1] = tri.x[1] - tri.x[0];
+    tri.step_x[2] = tri.y[1] - tri.y[2];
+    tri.step_y[2] = tri.x[2] - tri.x[1];
+
+    if (ras_edge(&tri, 1, tri.x[2], tri.y[2]) <= 0)
+        return;
+
+    if (rect) {
+        bound = *rect;
+    }
+    else {
+        bound.x0 = 0;
+        bound.y0 = 0;
+        bound.x1 = fbo.width;
+        bound.y1 = fbo.height;
+    }
+
+    int32_t left = MIN(tri.x[0], tri.x[1]);
+    left = MIN(left, tri.x[2]);
+    int32_t right = MAX(tri.x[0], tri.x[1]);
+    right = MAX(right, tri.x[2]);
+    int32_t top = MIN(tri.y[0], tri.y[1]);
+    top = MIN(top, tri.y[2]);
+    int32_t bottom = MAX(tri.y[0], tri.y[1]);
+    bottom = MAX(bottom, tri.y[2]);
+
+    if (left < bound.x0) left = bound.x0;
+    if (top < bound.y0) top = bound.y0;
+    if (right >= bound.x1) right = bound.x1 - 1;
+    if (bottom >= bound.y1) bottom = bound.y1 - 1;
+    if ((left > right) || (top > bottom))
+        return;
+
+    // Align to block grid, tiles are always made of whole blocks
+    left = left / BLOCK_SIZE * BLOCK_SIZE;
+    top = top / BLOCK_SIZE * BLOCK_SIZE;
+
+    for (int32_t y = top; y <= bottom; y += BLOCK_SIZE)
+        for (int32_t x = left; x <= right; x += BLOCK_SIZE)
+            ras_block(&tri, x, y, BLOCK_SIZE);
+}
+
+// Check the whole triangle against hierarchical Z within its bounding box
+static bool s3d_hiz_reject_triangle(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri,
+        S3D_RECT *rect, float *min_depth) {
+    FBO fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+
+    // Every covered pixel is within the triangle, nearest depth is on a vertex
+    float depth = tri->z.a0;
+    for (int i = 1; i < 3; i++) {
+        float z = tri->z.a0 + tri->z.dadx * (tri->x[i] - tri->x[0]) +
+                tri->z.dady * (tri->y[i] - tri->y[0]);
+        depth = fminf(depth, z);
+    }
+    *min_depth = depth;
+
+    int32_t left = MIN(tri->x[0], tri->x[1]);
+    left = MIN(left, tri->x[2]);
+    int32_t right = MAX(tri->x[0], tri->x[1]);
+    right = MAX(right, tri->x[2]);
+    int32_t top = MIN(tri->y[0], tri->y[1]);
+    top = MIN(top, tri->y[2]);
+    int32_t bottom = MAX(tri->y[0], tri->y[1]);
+    bottom = MAX(bottom, tri->y[2]);
+    if (rect) {
+        if (left < rect->x0) left = rect->x0;
+        if (top < rect->y0) top = rect->y0;
+        if (right >= rect->x1) right = rect->x1 - 1;
+        if (bottom >= rect->y1) bottom = rect->y1 - 1;
+    }
+
+    return s3d_hiz_reject(ctx, &fbo, left, top, right, bottom, depth);
+}
+
+static void s3d_rasterize(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri,
+        S3D_RECT *rect) {
+    float min_depth;
+
+    if (s3d_hiz_reject_triangle(ctx, tri, rect, &min_depth)) {
+        __atomic_fetch_add(&ctx->hiz_stats.triangles_rejected, 1,
+                __ATOMIC_RELAXED);
+        return;
+    }
+
+    switch (ctx->rasterizer) {
+    case RASTERIZER_FSM:
+        s3d_rasterize_triangle_fsm(ctx, tri, rect);
+        break;
+    case RASTERIZER_BLOCK:
+        s3d_rasterize_triangle_block(ctx, tri, rect, min_depth);
+        break;
+    }
+}
+
+void s3d_rasterize_triangle(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri,
+        S3D_RECT *rect) {
+    uint64_t trace = s3d_trace_span_begin(S3D_TRACE_ENABLED);
+    if (!ctx->stage_timing) {
+        s3d_rasterize(ctx, tri, rect);
+    }
+    else {
+        uint64_t start = s3d_timestamp();
+        s3d_rasterize(ctx, tri, rect);
+        uint64_t time = s3d_timestamp() - start;
+        S3D_STAT_ADD(ctx->stage_time.rasterize, time);
+        // Without tiled rendering, this is called from setup directly
+        if (!ctx->tiled_rendering)
+            ctx->stage_time.setup_rasterize += time;
+    }
+    s3d_trace_end("rasterize", trace);
+}
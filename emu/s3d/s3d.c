@@ -21,9 +21,11 @@
 // SOFTWARE.
 //
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
-#include <SDL.h>
+#include <unistd.h>
 #include "vecmath.h"
 #include "s3d.h"
 #include "utils.h"
@@ -35,42 +37,122 @@
 
 //#define DEBUG
 
-S3D_CONTEXT s3d_context;
-
-// Allocate from VRAM
-// Simple linear allocator without being able to free...
-static uint32_t s3d_malloc(uint32_t size) {
-    uint32_t mem = s3d_context.memptr;
-    assert((VRAM_SIZE - mem) > size);
-    s3d_context.memptr += size;
-    return mem;
-}
-
-static void s3d_free(uint32_t ptr) {
-    return;
-}
-
-void s3d_init(uint32_t width, uint32_t height) {
-    ra_init(&s3d_context.vao, sizeof(VAO));
-    ra_init(&s3d_context.vbo, sizeof(VBO));
-    ra_init(&s3d_context.ebo, sizeof(EBO));
-    ra_init(&s3d_context.fbo, sizeof(FBO));
-    ra_init(&s3d_context.tex, sizeof(TEX));
-    s3d_context.depth_test = true;
-    s3d_context.early_depth_test = true;
-    s3d_context.face_culling = true;
-    s3d_context.perspective_correct = true;
-    s3d_context.active_fbo = s3d_create_framebuffer(width, height, PF_RGBA8);
-    s3d_clear_color();
-    s3d_clear_depth();
+// Bound when no other program is
+static const S3D_PROGRAM default_program = {
+    .vs = simple_vs,
+    .vs_batch = simple_vs_batch,
+    .fs = simple_fs,
+    .fs_quad = simple_fs_quad,
+    .varying_count = 2
+};
+
+static const S3D_SAMPLER default_sampler = {
+    .filter = TEX_FILTER_BILINEAR,
+    .max_anisotropy = 1,
+    .lod_bias = 0.0f
+};
+
+static void s3d_reset_stats(S3D_CONTEXT *ctx) {
+    memset(&ctx->stats, 0, sizeof(S3D_STATS));
+    memset(&ctx->stage_time, 0, sizeof(S3D_STAGE_TIME));
+    ctx->stats.min_mip_level = INT32_MAX;
+    ctx->stats.max_mip_level = -1;
+}
+
+// Add object to a table, reusing IDs of deleted objects first
+static uint32_t s3d_add_object(RESIZABLE_ARRAY *table,
+        RESIZABLE_ARRAY *free_ids, void *object) {
+    if (free_ids->used_size != 0) {
+        free_ids->used_size--;
+        uint32_t id = ((uint32_t *)free_ids->buf)[free_ids->used_size];
+        memcpy((uint8_t *)table->buf + id * table->element_size, object,
+                table->element_size);
+        return id;
+    }
+    uint32_t id = table->used_size;
+    ra_push(table, object);
+    return id;
 }
 
-void s3d_deinit() {
-    ra_deinit(&s3d_context.vao);
-    ra_deinit(&s3d_context.vbo);
-    ra_deinit(&s3d_context.ebo);
-    ra_deinit(&s3d_context.fbo);
-    ra_deinit(&s3d_context.tex);
+static void s3d_remove_object(RESIZABLE_ARRAY *table,
+        RESIZABLE_ARRAY *free_ids, uint32_t id) {
+    assert(id < table->used_size);
+    ra_push(free_ids, &id);
+}
+
+S3D_CONTEXT *s3d_context_create(uint32_t width, uint32_t height,
+        S3D_VRAM_CONFIG *vram_config) {
+    S3D_CONTEXT *ctx = calloc(1, sizeof(S3D_CONTEXT));
+    assert(ctx);
+    ra_init(&ctx->vao, sizeof(VAO));
+    ra_init(&ctx->vbo, sizeof(VBO));
+    ra_init(&ctx->ebo, sizeof(EBO));
+    ra_init(&ctx->fbo, sizeof(FBO));
+    ra_init(&ctx->tex, sizeof(TEX));
+    ra_init(&ctx->program, sizeof(S3D_PROGRAM));
+    ra_init(&ctx->sampler, sizeof(S3D_SAMPLER));
+    ra_init(&ctx->vao_free, sizeof(uint32_t));
+    ra_init(&ctx->vbo_free, sizeof(uint32_t));
+    ra_init(&ctx->ebo_free, sizeof(uint32_t));
+    ra_init(&ctx->tex_free, sizeof(uint32_t));
+    ra_init(&ctx->program_free, sizeof(uint32_t));
+    ra_init(&ctx->sampler_free, sizeof(uint32_t));
+    s3d_vram_init(ctx, vram_config);
+    ctx->depth_test = true;
+    ctx->early_depth_test = true;
+    ctx->hiz = true;
+    ctx->fast_clear = true;
+    ctx->clear_color = 0;
+    ctx->clear_depth = 1.0f;
+    ctx->face_culling = true;
+    ctx->perspective_correct = true;
+    ctx->tiled_rendering = false;
+    ctx->rasterizer = RASTERIZER_FSM;
+    ctx->tex_layout = TEX_LAYOUT_PLANAR;
+    ctx->tex_format = TEX_FORMAT_RGB8;
+    ctx->guard_band = DEFAULT_GUARD_BAND;
+    s3d_reset_stats(ctx);
+    s3d_use_program(ctx, 0);
+    for (uint32_t i = 0; i < TMU_COUNT; i++)
+        s3d_bind_sampler(ctx, i, 0);
+    s3d_set_vertex_cache(ctx, VERTEX_CACHE_FULL, DEFAULT_VERTEX_CACHE_SIZE);
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1) cpu_count = 1;
+    s3d_set_worker_count(ctx, cpu_count);
+    s3d_coverage_init();
+    s3d_bc_init(ctx);
+    s3d_pool_init(ctx);
+    s3d_tiler_init(ctx);
+    s3d_queue_init(ctx);
+    ctx->active_fbo = s3d_create_framebuffer(ctx, width, height, PF_RGBA8,
+            FB_LAYOUT_TILED_4X4);
+    s3d_clear_color(ctx);
+    s3d_clear_depth(ctx);
+    return ctx;
+}
+
+void s3d_context_destroy(S3D_CONTEXT *ctx) {
+    s3d_queue_deinit(ctx);
+    s3d_tiler_deinit(ctx);
+    s3d_vertex_cache_deinit(ctx);
+    s3d_tex_cache_deinit(ctx);
+    s3d_bc_deinit(ctx);
+    s3d_pool_deinit(ctx);
+    ra_deinit(&ctx->vao);
+    ra_deinit(&ctx->vbo);
+    ra_deinit(&ctx->ebo);
+    ra_deinit(&ctx->fbo);
+    ra_deinit(&ctx->tex);
+    ra_deinit(&ctx->program);
+    ra_deinit(&ctx->sampler);
+    ra_deinit(&ctx->vao_free);
+    ra_deinit(&ctx->vbo_free);
+    ra_deinit(&ctx->ebo_free);
+    ra_deinit(&ctx->tex_free);
+    ra_deinit(&ctx->program_free);
+    ra_deinit(&ctx->sampler_free);
+    s3d_vram_deinit(ctx);
+    free(ctx);
 }
 
 static size_t get_pixel_width(PIXEL_FORMAT format) {
@@ -101,72 +183,193 @@ uint32_t s3d_map_rgb(uint8_t r, uint8_t g, uint8_t b) {
     return 0xff000000ul | (b << 16) | (g << 8) | (r);
 }
 
-uint32_t s3d_create_framebuffer(uint32_t width, uint32_t height, PIXEL_FORMAT format) {
+// Allocate the buffers of a framebuffer in VRAM
+static FBO s3d_init_framebuffer(S3D_CONTEXT *ctx, uint32_t width,
+        uint32_t height, PIXEL_FORMAT format, FB_LAYOUT layout) {
     size_t size = width * height * get_pixel_width(format);
     FBO fbo;
     fbo.width = width;
     fbo.height = height;
     fbo.size = size;
-    fbo.color_address = s3d_malloc(size);
-    fbo.depth_address = s3d_malloc(width * height * 4); // Always use 32 bit depth
-    uint32_t id = s3d_context.fbo.used_size;
-    ra_push(&s3d_context.fbo, &fbo);
+    fbo.layout = layout;
+    switch (layout) {
+    case FB_LAYOUT_LINEAR:
+        fbo.tile_shift = 0;
+        break;
+    case FB_LAYOUT_TILED_4X4:
+        fbo.tile_shift = 2;
+        break;
+    case FB_LAYOUT_TILED_8X8:
+        fbo.tile_shift = 3;
+        break;
+    default:
+        assert(0);
+        fbo.tile_shift = 0;
+        break;
+    }
+    // Tiled buffers are padded to whole micro-tiles
+    uint32_t tile_size = 1u << fbo.tile_shift;
+    fbo.tiles_x = (width + tile_size - 1) / tile_size;
+    uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+    size_t pixels = fbo.tiles_x * tiles_y * tile_size * tile_size;
+    fbo.color_address = s3d_malloc(ctx, pixels * get_pixel_width(format),
+            VRAM_ALIGNMENT);
+    // Always use 32 bit depth
+    fbo.depth_address = s3d_malloc(ctx, pixels * 4, VRAM_ALIGNMENT);
+    fbo.hiz_address = s3d_malloc(ctx, s3d_hiz_size(width, height),
+            VRAM_ALIGNMENT);
+    fbo.clear_address = s3d_malloc(ctx, s3d_clear_flags_size(width, height),
+            VRAM_ALIGNMENT);
+    memset(&ctx->vram[fbo.clear_address], 0,
+            s3d_clear_flags_size(width, height));
+    fbo.clear_color = 0;
+    fbo.clear_depth = 1.0f;
+    return fbo;
+}
+
+static void s3d_free_framebuffer(S3D_CONTEXT *ctx, FBO *fbo) {
+    s3d_free(ctx, fbo->color_address);
+    s3d_free(ctx, fbo->depth_address);
+    s3d_free(ctx, fbo->hiz_address);
+    s3d_free(ctx, fbo->clear_address);
+}
+
+uint32_t s3d_create_framebuffer(S3D_CONTEXT *ctx, uint32_t width,
+        uint32_t height, PIXEL_FORMAT format, FB_LAYOUT layout) {
+    FBO fbo = s3d_init_framebuffer(ctx, width, height, format, layout);
+    uint32_t id = ctx->fbo.used_size;
+    ra_push(&ctx->fbo, &fbo);
     printf("Created %d x %d framebuffer with ID %d (At 0x%08x)\n", width, height, id, fbo.color_address);
     return id;
 }
 
-void s3d_clear_color() {
-    FBO fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
-    memset(&s3d_context.vram[fbo.color_address], 0, fbo.size);
+void s3d_clear_color(S3D_CONTEXT *ctx) {
+    FBO *fbo = &((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+    fbo->clear_color = ctx->clear_color;
+    s3d_clear_tiles(ctx, fbo, CLEAR_COLOR);
+    if (!ctx->fast_clear)
+        s3d_resolve_tiles(ctx, fbo, CLEAR_COLOR);
 }
 
-void s3d_clear_depth() {
-    FBO fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
-    float *z_buffer = (float *)&s3d_context.vram[fbo.depth_address];
-    for (size_t i = 0; i < fbo.width * fbo.height; i++) {
-        z_buffer[i] = 1.0f;
-    }
+void s3d_clear_depth(S3D_CONTEXT *ctx) {
+    FBO *fbo = &((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+    fbo->clear_depth = ctx->clear_depth;
+    s3d_clear_tiles(ctx, fbo, CLEAR_DEPTH);
+    if (!ctx->fast_clear)
+        s3d_resolve_tiles(ctx, fbo, CLEAR_DEPTH);
+    s3d_hiz_clear(ctx, fbo, fbo->clear_depth);
+}
+
+void s3d_set_clear_color(S3D_CONTEXT *ctx, uint32_t color) {
+    ctx->clear_color = color;
+}
+
+void s3d_set_clear_depth(S3D_CONTEXT *ctx, float depth) {
+    ctx->clear_depth = depth;
+}
+
+void s3d_fast_clear(S3D_CONTEXT *ctx, bool enable) {
+    ctx->fast_clear = enable;
+}
+
+void s3d_depth_test(S3D_CONTEXT *ctx, bool enable) {
+    ctx->depth_test = enable;
+}
+
+void s3d_hierarchical_z(S3D_CONTEXT *ctx, bool enable) {
+    ctx->hiz = enable;
+}
+
+void s3d_get_hiz_stats(S3D_CONTEXT *ctx, S3D_HIZ_STATS *stats) {
+    *stats = ctx->last_hiz_stats;
+}
+
+void s3d_face_culling(S3D_CONTEXT *ctx, bool enable) {
+    ctx->face_culling = enable;
+}
+
+void s3d_tiled_rendering(S3D_CONTEXT *ctx, bool enable) {
+    ctx->tiled_rendering = enable;
 }
 
-void s3d_depth_test(bool enable) {
-    s3d_context.depth_test = enable;
+void s3d_set_worker_count(S3D_CONTEXT *ctx, size_t count) {
+    if (count < 1) count = 1;
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+    ctx->worker_count = count;
 }
 
-void s3d_face_culling(bool enable) {
-    s3d_context.face_culling = enable;
+void s3d_set_rasterizer(S3D_CONTEXT *ctx, RASTERIZER rasterizer) {
+    ctx->rasterizer = rasterizer;
 }
 
-uint32_t s3d_load_ebo(void *buffer, size_t size) {
+void s3d_set_guard_band(S3D_CONTEXT *ctx, uint32_t pixels) {
+    ctx->guard_band = pixels;
+}
+
+void s3d_get_clip_stats(S3D_CONTEXT *ctx, S3D_CLIP_STATS *stats) {
+    *stats = ctx->last_clip_stats;
+}
+
+void s3d_set_vertex_cache(S3D_CONTEXT *ctx, VERTEX_CACHE mode, size_t size) {
+    // Need to hold at least 1 triangle
+    if (size < 3) size = 3;
+    if (size > MAX_VERTEX_CACHE_SIZE) size = MAX_VERTEX_CACHE_SIZE;
+    ctx->vertex_cache = mode;
+    ctx->vertex_cache_size = size;
+}
+
+void s3d_get_vertex_cache_stats(S3D_CONTEXT *ctx,
+        S3D_VERTEX_CACHE_STATS *stats) {
+    *stats = ctx->last_vertex_cache_stats;
+}
+
+void s3d_enable_stats(S3D_CONTEXT *ctx, bool enable) {
+    ctx->stats_enabled = enable;
+    if (!enable)
+        ctx->stage_timing = false;
+}
+
+void s3d_enable_stage_timing(S3D_CONTEXT *ctx, bool enable) {
+    ctx->stage_timing = enable;
+    if (enable)
+        ctx->stats_enabled = true;
+}
+
+void s3d_get_stats(S3D_CONTEXT *ctx, S3D_STATS *stats) {
+    *stats = ctx->last_stats;
+}
+
+uint32_t s3d_load_ebo(S3D_CONTEXT *ctx, void *buffer, size_t size) {
     EBO ebo;
-    ebo.address = s3d_malloc(size);
+    ebo.address = s3d_malloc(ctx, size, VRAM_ALIGNMENT);
     ebo.size = size;
-    memcpy(&s3d_context.vram[ebo.address], buffer, size);
-    uint32_t id = s3d_context.ebo.used_size;
-    ra_push(&s3d_context.ebo, &ebo);
+    memcpy(&ctx->vram[ebo.address], buffer, size);
+    uint32_t id = s3d_add_object(&ctx->ebo, &ctx->ebo_free,
+            &ebo);
     printf("Loaded %d bytes EBO to ID %d (At 0x%08x)\n", size, id, ebo.address);
     return id;
 }
 
-uint32_t s3d_load_vbo(void *buffer, size_t size) {
+uint32_t s3d_load_vbo(S3D_CONTEXT *ctx, void *buffer, size_t size) {
     VBO vbo;
-    vbo.address = s3d_malloc(size);
+    vbo.address = s3d_malloc(ctx, size, VRAM_ALIGNMENT);
     vbo.size = size;
-    memcpy(&s3d_context.vram[vbo.address], buffer, size);
-    uint32_t id = s3d_context.vbo.used_size;
-    ra_push(&s3d_context.vbo, &vbo);
+    memcpy(&ctx->vram[vbo.address], buffer, size);
+    uint32_t id = s3d_add_object(&ctx->vbo, &ctx->vbo_free,
+            &vbo);
     printf("Loaded %d bytes VBO to ID %d (At 0x%08x)\n", size, id, vbo.address);
     return id;
 }
 
-uint32_t s3d_bind_vao(uint32_t ebo_id, uint32_t vbo_id, uint32_t attr_size,
-        uint32_t attr_stride) {
+uint32_t s3d_bind_vao(S3D_CONTEXT *ctx, uint32_t ebo_id, uint32_t vbo_id,
+        uint32_t attr_size, uint32_t attr_stride) {
     VAO vao;
     vao.ebo_id = ebo_id;
     vao.vbo_id = vbo_id;
     vao.attribute_size = attr_size;
     vao.attribute_stride = attr_stride;
-    uint32_t id = s3d_context.vao.used_size;
-    ra_push(&s3d_context.vao, &vao);
+    uint32_t id = s3d_add_object(&ctx->vao, &ctx->vao_free,
+            &vao);
     printf("Binded EBO %d VBO %d to ID %d\n", ebo_id, vbo_id, id);
     return id;
 }
@@ -201,11 +404,60 @@ uint8_t *s3d_create_mipmap(uint8_t *image, size_t side, size_t level) {
     return target;
 }
 
-uint32_t s3d_load_tex(void *buffer, size_t width, size_t height, size_t channels, size_t byte_per_channel) {
+// Interleaved RGBA8, every level in Morton order, see TEX_LAYOUT_MORTON
+static uint8_t *s3d_create_mipmap_morton(uint8_t *image, size_t side,
+        size_t level, size_t *size) {
+    *size = s3d_morton_level_offset(level, 0) + 4;
+    uint8_t *temp = malloc(side * side * 3);
+    uint8_t *target = malloc(*size);
+    assert(temp);
+    assert(target);
+    for (int l = level; l >= 0; l--) {
+        uint32_t level_side = 1ul << l;
+        stbir_resize_uint8(image, side, side, 0, temp, level_side, level_side, 0, 3);
+        uint8_t *base = &target[s3d_morton_level_offset(level, l)];
+        for (size_t y = 0; y < level_side; y++) {
+            for (size_t x = 0; x < level_side; x++) {
+                uint8_t *pixel = &temp[(y * level_side + x) * 3];
+                uint8_t *texel = &base[s3d_morton_encode(x, y) * 4];
+                texel[0] = pixel[0];
+                texel[1] = pixel[1];
+                texel[2] = pixel[2];
+                texel[3] = 0xff;
+            }
+        }
+    }
+    free(temp);
+    return target;
+}
+
+// Block compressed, see TEX_FORMAT_BC1 and TEX_FORMAT_BC3
+static uint8_t *s3d_create_mipmap_bc(TEX_FORMAT format, uint8_t *image,
+        size_t side, size_t channels, size_t level, size_t *size) {
+    uint32_t block_size = s3d_bc_block_size(format);
+    *size = (s3d_bc_level_offset(level, 0) + 1) * block_size;
+    uint8_t *temp = malloc(side * side * channels);
+    uint8_t *target = malloc(*size);
+    assert(temp);
+    assert(target);
+    for (int l = level; l >= 0; l--) {
+        uint32_t level_side = 1ul << l;
+        stbir_resize_uint8(image, side, side, 0, temp, level_side, level_side, 0, channels);
+        s3d_bc_encode_level(format, temp, level_side, channels,
+                &target[s3d_bc_level_offset(level, l) * block_size]);
+    }
+    free(temp);
+    return target;
+}
+
+uint32_t s3d_load_tex(S3D_CONTEXT *ctx, void *buffer, size_t width,
+        size_t height, size_t channels, size_t byte_per_channel) {
     TEX tex;
     // Only support 8bpc RGB format now!
     assert(byte_per_channel == 1);
-    if (channels == 4) {
+    // Alpha is only kept by compressed formats
+    bool compressed = (ctx->tex_format != TEX_FORMAT_RGB8);
+    if ((channels == 4) && !compressed) {
         // Drop A channel and try again
         uint32_t texid;
         uint8_t *temp = malloc(width * height * 3);
@@ -217,11 +469,11 @@ uint32_t s3d_load_tex(void *buffer, size_t width, size_t height, size_t channels
             *dst++ = *src++;
             src++;
         }
-        texid = s3d_load_tex(temp, width, height, 3, 1);
+        texid = s3d_load_tex(ctx, temp, width, height, 3, 1);
         free(temp);
         return texid;
     }
-    assert(channels == 3);
+    assert((channels == 3) || (channels == 4));
 
     // Determine the actual allocated size
     float scale_x = (float)MAX_TEXTURE_SIZE / (float)width;
@@ -241,81 +493,159 @@ uint32_t s3d_load_tex(void *buffer, size_t width, size_t height, size_t channels
     target_width = 1ul << level;
     target_height = 1ul << level;
     // Convert to format accepted by s3d_create_mipmap
-    uint8_t *temp = malloc(target_height * target_width * 3);
-    stbir_resize_uint8(buffer, width, height, 0, temp, target_width, target_height, 0, 3);
-
-    uint8_t *mipmap = s3d_create_mipmap(temp, target_width, level);
+    uint8_t *temp = malloc(target_height * target_width * channels);
+    stbir_resize_uint8(buffer, width, height, 0, temp, target_width, target_height, 0, channels);
+
+    uint8_t *mipmap;
+    size_t size;
+    if (compressed) {
+        mipmap = s3d_create_mipmap_bc(ctx->tex_format, temp, target_width,
+                channels, level, &size);
+    }
+    else if (ctx->tex_layout == TEX_LAYOUT_MORTON) {
+        mipmap = s3d_create_mipmap_morton(temp, target_width, level, &size);
+    }
+    else {
+        mipmap = s3d_create_mipmap(temp, target_width, level);
+        size = target_width * target_height * 4;
+    }
     free(temp);
-    size_t size = target_width * target_height * 4;
-    tex.address = s3d_malloc(size);
+    tex.address = s3d_malloc(ctx, size, VRAM_ALIGNMENT);
     tex.width = target_width;
     tex.height = target_height;
     tex.mipmap_levels = level;
+    tex.layout = ctx->tex_layout;
+    tex.format = ctx->tex_format;
 
-    memcpy(&s3d_context.vram[tex.address], mipmap, size);
+    memcpy(&ctx->vram[tex.address], mipmap, size);
     free(mipmap);
-    uint32_t id = s3d_context.tex.used_size;
-    ra_push(&s3d_context.tex, &tex);
-    printf("Loaded %d x %d (from %d x %d) texture to ID %d (At 0x%08x)\n",
-            target_width, target_height, width, height, id, tex.address);
+    // Cached lines could be from a deleted texture at the same address
+    s3d_tex_cache_invalidate(ctx);
+    s3d_bc_invalidate(ctx);
+    uint32_t id = s3d_add_object(&ctx->tex, &ctx->tex_free,
+            &tex);
+    printf("Loaded %d x %d (from %zu x %zu) texture to ID %d (At 0x%08x, %zu bytes)\n",
+            target_width, target_height, width, height, id, tex.address, size);
     return id + 1;
 }
 
-void s3d_bind_texture(uint32_t tmu, uint32_t tex_id) {
+void s3d_set_tex_layout(S3D_CONTEXT *ctx, TEX_LAYOUT layout) {
+    ctx->tex_layout = layout;
+}
+
+void s3d_set_tex_format(S3D_CONTEXT *ctx, TEX_FORMAT format) {
+    ctx->tex_format = format;
+}
+
+void s3d_bind_texture(S3D_CONTEXT *ctx, uint32_t tmu, uint32_t tex_id) {
     assert(tmu < TMU_COUNT);
     //printf("Assigning tex ID %d to TMU %d\n", tex_id, tmu);
     if (tex_id > 0) {
-        s3d_context.tmu[tmu].enabled = true;
-        TEX *tex = &((TEX *)s3d_context.tex.buf)[tex_id - 1];
-        s3d_context.tmu[tmu].address = tex->address;
-        s3d_context.tmu[tmu].width = tex->width;
-        s3d_context.tmu[tmu].height = tex->height;
-        s3d_context.tmu[tmu].mipmap_levels = tex->mipmap_levels;
+        ctx->tmu[tmu].enabled = true;
+        TEX *tex = &((TEX *)ctx->tex.buf)[tex_id - 1];
+        ctx->tmu[tmu].address = tex->address;
+        ctx->tmu[tmu].width = tex->width;
+        ctx->tmu[tmu].height = tex->height;
+        ctx->tmu[tmu].mipmap_levels = tex->mipmap_levels;
+        ctx->tmu[tmu].layout = tex->layout;
+        ctx->tmu[tmu].format = tex->format;
+    }
+    else {
+        ctx->tmu[tmu].enabled = false;
+    }
+}
+
+uint32_t s3d_create_sampler(S3D_CONTEXT *ctx, const S3D_SAMPLER *sampler) {
+    assert(sampler->filter <= TEX_FILTER_ANISOTROPIC);
+    assert((sampler->max_anisotropy >= 1) &&
+            (sampler->max_anisotropy <= S3D_MAX_ANISOTROPY));
+    uint32_t id = s3d_add_object(&ctx->sampler, &ctx->sampler_free,
+            (void *)sampler);
+    return id + 1;
+}
+
+void s3d_bind_sampler(S3D_CONTEXT *ctx, uint32_t tmu, uint32_t sampler_id) {
+    assert(tmu < TMU_COUNT);
+    if (sampler_id > 0) {
+        assert(sampler_id <= ctx->sampler.used_size);
+        ctx->tmu[tmu].sampler =
+                ((S3D_SAMPLER *)ctx->sampler.buf)[sampler_id - 1];
+    }
+    else {
+        ctx->tmu[tmu].sampler = default_sampler;
+    }
+}
+
+uint32_t s3d_create_program(S3D_CONTEXT *ctx, const S3D_PROGRAM *program) {
+    assert(program->vs);
+    // One vec4 of MAX_VARYING is taken by the position
+    assert(program->varying_count <= MAX_VARYING - 4);
+    uint32_t id = s3d_add_object(&ctx->program, &ctx->program_free,
+            (void *)program);
+    return id + 1;
+}
+
+void s3d_use_program(S3D_CONTEXT *ctx, uint32_t program_id) {
+    if (program_id > 0) {
+        assert(program_id <= ctx->program.used_size);
+        ctx->active_program = ((S3D_PROGRAM *)ctx->program.buf)[program_id - 1];
     }
     else {
-        s3d_context.tmu[tmu].enabled = false;
+        ctx->active_program = default_program;
     }
+    ctx->varying_count = ctx->active_program.varying_count;
+}
+
+void s3d_update_uniform(S3D_CONTEXT *ctx, void *buffer, size_t size) {
+    s3d_update_uniform_range(ctx, 0, buffer, size);
 }
 
-void s3d_update_uniform(void *buffer, size_t size) {
-    assert(size < UNIFORM_SIZE);
-    memcpy(s3d_context.uniforms, buffer, size);
+void s3d_update_uniform_range(S3D_CONTEXT *ctx, size_t offset, void *buffer,
+        size_t size) {
+    assert(offset + size <= UNIFORM_SIZE);
+    memcpy(&ctx->uniforms[offset], buffer, size);
 }
 
-void s3d_set_varying_count(size_t count) {
-    s3d_context.varying_count = count;
+void s3d_set_varying_count(S3D_CONTEXT *ctx, size_t count) {
+    assert(count <= MAX_VARYING - 4);
+    ctx->varying_count = count;
 }
 
-void s3d_set_pixel(FBO *fbo, int32_t x, int32_t y, uint32_t color) {
+void s3d_set_pixel(S3D_CONTEXT *ctx, FBO *fbo, int32_t x, int32_t y,
+        uint32_t color) {
     if (x < 0) return;
     if (y < 0) return;
     if (x >= fbo->width) return;
     if (y >= fbo->height) return;
-    uint32_t *buf = (uint32_t *)&s3d_context.vram[fbo->color_address];
-    buf[y * fbo->width + x] = color;
+    uint32_t *buf = (uint32_t *)&ctx->vram[fbo->color_address];
+    s3d_resolve_pixel(ctx, fbo, x, y);
+    buf[s3d_pixel_index(fbo, x, y)] = color;
 }
 
-void s3d_xline(FBO *fbo, int32_t x0, int32_t y0, int32_t x1, uint32_t color)  {
+void s3d_xline(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0,
+        int32_t x1, uint32_t color)  {
     int32_t i, xx0, xx1;
 
     xx0 = MIN(x0, x1);
     xx1 = MAX(x0, x1);
     for (i = xx0; i <= xx1; i++) {
-        s3d_set_pixel(fbo, i, y0, color);
+        s3d_set_pixel(ctx, fbo, i, y0, color);
     }
 }
 
-void s3d_yline(FBO *fbo, int32_t x0, int32_t y0, int32_t y1, uint32_t color)  {
+void s3d_yline(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0,
+        int32_t y1, uint32_t color)  {
     int32_t i, yy0, yy1;
 
     yy0 = MIN(y0, y1);
     yy1 = MAX(y0, y1);
     for (i = yy0; i <= yy1; i++) {
-        s3d_set_pixel(fbo, x0, i, color);
+        s3d_set_pixel(ctx, fbo, x0, i, color);
     }
 }
 
-void s3d_line(FBO *fbo, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t color) {
+void s3d_line(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0,
+        int32_t x1, int32_t y1, uint32_t color) {
     int32_t temp;
     int32_t dx,dy;
     int32_t s1,s2,status,i;
@@ -346,13 +676,13 @@ void s3d_line(FBO *fbo, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t
         status = 0;
 
     if(dx==0)
-        s3d_yline(fbo, x0, y0, y1, color);
+        s3d_yline(ctx, fbo, x0, y0, y1, color);
     if(dy==0)
-        s3d_xline(fbo, x0, y0, x1, color);
+        s3d_xline(ctx, fbo, x0, y0, x1, color);
 
     sub = 2 * Dy - Dx;
     for (i = 0; i < Dx; i++) {
-        s3d_set_pixel(fbo, x0, y0, color);
+        s3d_set_pixel(ctx, fbo, x0, y0, color);
         if (sub >= 0) {
             if(status == 1)
                 x0 += s1;
@@ -395,86 +725,125 @@ static int32_t int_signed_area(int32_t v0x, int32_t v0y, int32_t v1x, int32_t v1
     return vec1x * vec2y - vec1y * vec2x;
 }
 
-void s3d_render(uint32_t vao_id) {
+void s3d_render(S3D_CONTEXT *ctx, uint32_t vao_id) {
     // TODO: Add in RV32IF simulator
     // TODO: Implement this thing as an scheduler, like an actual GPU
 
 #if 1
-    //printf("Memory usage: %d bytes\n", s3d_context.memptr);
-    VAO vao = ((VAO *)s3d_context.vao.buf)[vao_id];
-    VBO vbo = ((VBO *)s3d_context.vbo.buf)[vao.vbo_id];
-    EBO ebo = ((EBO *)s3d_context.ebo.buf)[vao.ebo_id];
-    FBO fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
-
-    uint32_t *indices = (uint32_t *)&s3d_context.vram[ebo.address];
-    float *attributes = (float *)&s3d_context.vram[vbo.address];
-    for (uint32_t i = 0; i < ebo.size / sizeof(uint32_t) / 3; i++) {
+    uint64_t trace = s3d_trace_begin();
+    s3d_select_quad_kernel(ctx);
+    VAO vao = ((VAO *)ctx->vao.buf)[vao_id];
+    VBO vbo = ((VBO *)ctx->vbo.buf)[vao.vbo_id];
+    EBO ebo = ((EBO *)ctx->ebo.buf)[vao.ebo_id];
+
+    uint32_t *indices = (uint32_t *)&ctx->vram[ebo.address];
+    float *attributes = (float *)&ctx->vram[vbo.address];
+    uint32_t vertex_count = vbo.size / sizeof(float) / vao.attribute_stride;
+    uint32_t index_count = ebo.size / sizeof(uint32_t);
+    s3d_vertex_cache_begin(ctx, attributes, vao.attribute_stride,
+            vertex_count, indices, index_count);
+    for (uint32_t i = 0; i < index_count / 3; i++) {
 
         //printf("Input triangle %d\n", i);
         //if ((i != 1) && (i != 0)) continue;
         //if ((i != 3)) continue;
 
         // START OF VS STAGE
-        POST_VS_VERTEX post_vs_vertex[3] = {0};
+        POST_VS_VERTEX post_vs_vertex[3];
+        POST_VS_VERTEX *vertex[3];
 
         for (uint32_t j = 0; j < 3; j++) {
-            uint32_t index = indices[i * 3 + j];
-            simple_vs(
-                (UNIFORM *)s3d_context.uniforms,
-                &attributes[vao.attribute_stride * index],
-                &post_vs_vertex[j].varying[0],
-                &post_vs_vertex[j].position
-            );
-
+            vertex[j] = s3d_vertex_cache_fetch(ctx, indices[i * 3 + j],
+                    &post_vs_vertex[j]);
         }
 
-        s3d_setup_triangle(&post_vs_vertex[0], &post_vs_vertex[1],
-                &post_vs_vertex[2]);
+        uint64_t trace_setup = s3d_trace_begin();
+        if (ctx->stage_timing) {
+            uint64_t start = s3d_timestamp();
+            s3d_setup_triangle(ctx, vertex[0], vertex[1], vertex[2]);
+            ctx->stage_time.setup += s3d_timestamp() - start;
+        }
+        else {
+            s3d_setup_triangle(ctx, vertex[0], vertex[1], vertex[2]);
+        }
+        s3d_trace_end("setup", trace_setup);
     }
+
+    if (ctx->tiled_rendering)
+        s3d_tiler_flush(ctx);
+    s3d_trace_end("s3d_render", trace);
 #endif
 
 #if 0
     // Check texture mapping
-    // TMU tmu = s3d_context.tmu[0];
+    // TMU tmu = ctx->tmu[0];
     // if (!tmu.enabled)
     //     return;
-    // FBO active_fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
+    // FBO active_fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
     // uint32_t width = MIN(active_fbo.width, tmu.width * 2);
     // uint32_t height = MIN(active_fbo.height, tmu.height * 2);
     // for (int y = 0; y < height; y++) {
     //     for (int x = 0; x < width; x++) {
     //         uint32_t address = tmu.address + (y * tmu.width * 2 + x);
-    //         uint32_t r = s3d_context.vram[address];
+    //         uint32_t r = ctx->vram[address];
     //         uint32_t color = s3d_map_rgb(r, r, r);
-    //         s3d_set_pixel(&active_fbo, x, y, color); 
+    //         s3d_set_pixel(ctx, &active_fbo, x, y, color); 
     //     }
     // }
-    TMU tmu = s3d_context.tmu[0];
+    TMU tmu = ctx->tmu[0];
     if (!tmu.enabled)
         return;
-    FBO active_fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
+    FBO active_fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
     uint32_t width = active_fbo.width;
     uint32_t height = active_fbo.height;
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
             VEC2 tex_coord = {(float)x / width, (float)y / height};
-            VEC4 color = s3d_tex_lookup(0, 0, tex_coord);
+            VEC4 color = s3d_tex_lookup(ctx, 0, 0, tex_coord);
             uint32_t c = s3d_map_rgb((int)(color.x * 255.0f),
                     (int)(color.y * 255.0f), (int)(color.z * 255.0f));
-            s3d_set_pixel(&active_fbo, x, y, c); 
+            s3d_set_pixel(ctx, &active_fbo, x, y, c); 
         }
     }
 #endif
 
-    //s3d_line(&fbo, 0, 0, 639, 479, 0xff0000ff);
-}
-
-int min_level = 100;
-int max_level = -1;
-
-void s3d_render_copy(uint8_t *destination) {
-    FBO active_fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
-    uint32_t *source = &s3d_context.vram[active_fbo.color_address];
+    //s3d_line(ctx, &fbo, 0, 0, 639, 479, 0xff0000ff);
+}
+
+// Latch statistics of the finished frame
+static void s3d_end_frame(S3D_CONTEXT *ctx) {
+    if (ctx->stats_enabled) {
+        S3D_STATS *stats = &ctx->stats;
+        S3D_CLIP_STATS *clip = &ctx->clip_stats;
+        S3D_STAGE_TIME *time = &ctx->stage_time;
+        stats->vertices_shaded = ctx->vertex_cache_stats.misses;
+        stats->primitives_in = clip->trivially_accepted +
+                clip->guard_band_accepted + clip->trivially_rejected +
+                clip->clipped;
+        stats->primitives_clipped = clip->clipped;
+        stats->primitives_culled += clip->trivially_rejected;
+        stats->setup_ns = time->setup - time->setup_rasterize;
+        stats->rasterize_ns = time->rasterize - time->fsg;
+        stats->fsg_ns = time->fsg - time->tmu;
+        stats->tmu_ns = time->tmu;
+    }
+    ctx->last_stats = ctx->stats;
+    s3d_reset_stats(ctx);
+
+    ctx->last_clip_stats = ctx->clip_stats;
+    memset(&ctx->clip_stats, 0, sizeof(S3D_CLIP_STATS));
+    ctx->last_hiz_stats = ctx->hiz_stats;
+    memset(&ctx->hiz_stats, 0, sizeof(S3D_HIZ_STATS));
+    ctx->last_vertex_cache_stats = ctx->vertex_cache_stats;
+    memset(&ctx->vertex_cache_stats, 0,
+            sizeof(S3D_VERTEX_CACHE_STATS));
+    s3d_tex_cache_end_frame(ctx);
+}
+
+void s3d_render_copy(S3D_CONTEXT *ctx, uint8_t *destination) {
+    uint64_t trace = s3d_trace_begin();
+    FBO active_fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+    uint32_t *source = &ctx->vram[active_fbo.color_address];
 #if 0
     printf("YX ");
     for (int j = 0; j < active_fbo.width; j++) {
@@ -489,25 +858,103 @@ void s3d_render_copy(uint8_t *destination) {
         putchar('\n');
     }
 #endif
-    printf("Mipmap [%d, %d]\n", min_level, max_level);
-    min_level = 100;
-    max_level = -1;
+    s3d_end_frame(ctx);
 
-    memcpy((void *)destination, (const void *)source, active_fbo.size);
-}
+    s3d_resolve_tiles(ctx, &active_fbo, CLEAR_COLOR);
+    if (active_fbo.layout == FB_LAYOUT_LINEAR) {
+        memcpy((void *)destination, (const void *)source, active_fbo.size);
+        s3d_trace_end("present", trace);
+        return;
+    }
 
-void s3d_delete_ebo(uint32_t ebo_id) {
+    // Detile, each line of a micro-tile is contiguous in both buffers
+    uint32_t *target = (uint32_t *)destination;
+    uint32_t tile_size = 1u << active_fbo.tile_shift;
+    for (uint32_t y = 0; y < active_fbo.height; y++) {
+        for (uint32_t x = 0; x < active_fbo.width; x += tile_size) {
+            uint32_t count = MIN(tile_size, active_fbo.width - x);
+            memcpy(&target[y * active_fbo.width + x],
+                    &source[s3d_pixel_index(&active_fbo, x, y)],
+                    count * sizeof(uint32_t));
+        }
+    }
+    s3d_trace_end("present", trace);
+}
+
+void s3d_create_swap_chain(S3D_CONTEXT *ctx, uint32_t count) {
+    assert(ctx->swap_chain_length == 0);
+    assert((count >= 1) && (count <= MAX_SWAP_CHAIN));
+    // Linear so presented images could be scanned out as is. The default
+    // framebuffer is replaced in place by the first buffer.
+    FBO *fbo = &((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+    uint32_t width = fbo->width;
+    uint32_t height = fbo->height;
+    s3d_free_framebuffer(ctx, fbo);
+    *fbo = s3d_init_framebuffer(ctx, width, height, PF_RGBA8,
+            FB_LAYOUT_LINEAR);
+    ctx->swap_chain[0] = ctx->active_fbo;
+    for (uint32_t i = 1; i < count; i++) {
+        ctx->swap_chain[i] = s3d_create_framebuffer(ctx, width, height,
+                PF_RGBA8, FB_LAYOUT_LINEAR);
+    }
+    ctx->swap_chain_length = count;
+    ctx->back_buffer = 0;
+    ctx->active_fbo = ctx->swap_chain[0];
+    s3d_clear_color(ctx);
+    s3d_clear_depth(ctx);
+}
 
+uint8_t *s3d_present(S3D_CONTEXT *ctx) {
+    assert(ctx->swap_chain_length != 0);
+    uint64_t trace = s3d_trace_begin();
+    FBO fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+    s3d_end_frame(ctx);
+    s3d_resolve_tiles(ctx, &fbo, CLEAR_COLOR);
+    ctx->back_buffer = (ctx->back_buffer + 1) % ctx->swap_chain_length;
+    ctx->active_fbo = ctx->swap_chain[ctx->back_buffer];
+    s3d_trace_end("present", trace);
+    return &ctx->vram[fbo.color_address];
 }
 
-void s3d_delete_vbo(uint32_t vbo_id) {
+void s3d_delete_ebo(S3D_CONTEXT *ctx, uint32_t ebo_id) {
+    EBO ebo = ((EBO *)ctx->ebo.buf)[ebo_id];
+    s3d_free(ctx, ebo.address);
+    s3d_remove_object(&ctx->ebo, &ctx->ebo_free, ebo_id);
+}
 
+void s3d_delete_vbo(S3D_CONTEXT *ctx, uint32_t vbo_id) {
+    VBO vbo = ((VBO *)ctx->vbo.buf)[vbo_id];
+    s3d_free(ctx, vbo.address);
+    s3d_remove_object(&ctx->vbo, &ctx->vbo_free, vbo_id);
 }
 
-void s3d_delete_vao(uint32_t vao_id) {
+void s3d_delete_vao(S3D_CONTEXT *ctx, uint32_t vao_id) {
+    s3d_remove_object(&ctx->vao, &ctx->vao_free, vao_id);
+}
 
+void s3d_delete_tex(S3D_CONTEXT *ctx, uint32_t tex_id) {
+    // ID 0 means no texture
+    if (tex_id == 0)
+        return;
+    TEX tex = ((TEX *)ctx->tex.buf)[tex_id - 1];
+    for (int i = 0; i < TMU_COUNT; i++) {
+        if (ctx->tmu[i].enabled &&
+                (ctx->tmu[i].address == tex.address))
+            ctx->tmu[i].enabled = false;
+    }
+    s3d_free(ctx, tex.address);
+    s3d_remove_object(&ctx->tex, &ctx->tex_free, tex_id - 1);
+    // The memory could be reused by another texture
+    s3d_tex_cache_invalidate(ctx);
+    s3d_bc_invalidate(ctx);
 }
 
-void s3d_delete_tex(uint32_t tex_id) {
+void s3d_delete_program(S3D_CONTEXT *ctx, uint32_t program_id) {
+    assert(program_id > 0);
+    s3d_remove_object(&ctx->program, &ctx->program_free, program_id - 1);
+}
 
+void s3d_delete_sampler(S3D_CONTEXT *ctx, uint32_t sampler_id) {
+    assert(sampler_id > 0);
+    s3d_remove_object(&ctx->sampler, &ctx->sampler_free, sampler_id - 1);
 }
@@ -25,6 +25,49 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Every context is an independent GPU with its own VRAM, objects, states and
+// worker threads. Different contexts can be used from different threads, a
+// single context must only be used by one thread at a time.
+typedef struct S3D_CONTEXT S3D_CONTEXT;
+// Recorded list of commands, executed on the GPU thread of a context once
+// submitted. Must not be reset or destroyed before its fence signaled.
+typedef struct S3D_CMDBUF S3D_CMDBUF;
+// Signaled once all commands of a submission have been executed
+typedef uint64_t S3D_FENCE;
+
+#define S3D_TMU_COUNT (1)
+
+// Shaders are C functions for now, until the shader core is emulated.
+// uniforms points to the uniform buffer of the context.
+#define VS_BATCH_SIZE (8)
+typedef float VS_LANES __attribute__((vector_size(VS_BATCH_SIZE * sizeof(float))));
+typedef void (*S3D_VS)(void *uniforms, float *attributes, float *varying,
+        VEC4 *position);
+// Same as S3D_VS for VS_BATCH_SIZE vertices, in SoA layout
+typedef void (*S3D_VS_BATCH)(void *uniforms, VS_LANES *attributes,
+        VS_LANES *varying, VS_LANES *position);
+typedef void (*S3D_FS)(S3D_CONTEXT *ctx, void *uniforms, float *varying,
+        float *ddx, float *ddy, VEC3 *frag_color, float *frag_depth);
+// Pixels of a 2x2 quad in 4-wide SIMT lanes, in the order
+// 0 1
+// 2 3
+#define FS_LANE_COUNT (4)
+typedef float FS_LANES __attribute__((vector_size(FS_LANE_COUNT * sizeof(float))));
+// Same as S3D_FS for a whole quad, in SoA layout. Derivatives are taken
+// between lanes. Lanes not set in masks only help with derivatives, their
+// results are discarded. frag_color is r, g, b.
+typedef void (*S3D_FS_QUAD)(S3D_CONTEXT *ctx, void *uniforms,
+        const bool *masks, FS_LANES *varying, FS_LANES *frag_color,
+        FS_LANES *frag_depth);
+
+typedef struct {
+    S3D_VS vs;
+    S3D_VS_BATCH vs_batch; // Optional, vs is used per vertex if NULL
+    S3D_FS fs; // NULL for depth only rendering, color is left untouched
+    S3D_FS_QUAD fs_quad; // Optional, fs is used per pixel if NULL
+    uint32_t varying_count; // Number of floats passed from VS to FS
+} S3D_PROGRAM;
+
 typedef enum {
     PF_RGB8,
     PF_RGBA8,
@@ -34,50 +77,312 @@ typedef enum {
     PF_RGBA32F
 } PIXEL_FORMAT;
 
-// Initialize S3D, create window output
-void s3d_init(uint32_t width, uint32_t height);
-// Deinitialize S3D, close window
-void s3d_deinit();
+// Framebuffer memory layout. Tiled layouts store each micro-tile
+// contiguously (row-major within the tile), tiles are stored row-major.
+typedef enum {
+    FB_LAYOUT_LINEAR,
+    FB_LAYOUT_TILED_4X4,
+    FB_LAYOUT_TILED_8X8
+} FB_LAYOUT;
+
+// Texture memory layout
+typedef enum {
+    // Separate R, G and B planes for every level, same as the hardware
+    TEX_LAYOUT_PLANAR,
+    // Interleaved RGBA8 texels in Morton order, levels stored contiguously
+    // from the largest one. 4x4 texels share one 64 byte line.
+    TEX_LAYOUT_MORTON
+} TEX_LAYOUT;
+
+// Texture storage format
+typedef enum {
+    TEX_FORMAT_RGB8, // Uncompressed, stored in the texture layout
+    TEX_FORMAT_BC1, // 8 bytes per 4x4 block, RGB, alpha is dropped
+    TEX_FORMAT_BC3 // 16 bytes per 4x4 block, RGBA
+} TEX_FORMAT;
+
+// Texture filtering, the LOD is taken from the texture coordinate
+// derivatives. When magnified, every filter but nearest is bilinear.
+typedef enum {
+    TEX_FILTER_NEAREST, // 1 texel of the nearest level
+    TEX_FILTER_BILINEAR, // 2x2 texels of the nearest level
+    TEX_FILTER_TRILINEAR, // 2x2 texels of the 2 nearest levels, blended
+    TEX_FILTER_ANISOTROPIC // Trilinear taps along the major axis
+} TEX_FILTER;
+
+#define S3D_MAX_ANISOTROPY (16)
+
+typedef struct {
+    TEX_FILTER filter;
+    uint32_t max_anisotropy; // Taps for TEX_FILTER_ANISOTROPIC, 1 to 16
+    float lod_bias; // Added to log2 of the footprint
+} S3D_SAMPLER;
+
+typedef enum {
+    RASTERIZER_FSM, // Zig-zag state machine, same as the hardware
+    RASTERIZER_BLOCK // Hierarchical block based edge function rasterizer
+} RASTERIZER;
+
+typedef enum {
+    VERTEX_CACHE_NONE, // Shade every vertex of every triangle
+    VERTEX_CACHE_FIFO, // FIFO cache with configurable size, like hardware
+    VERTEX_CACHE_FULL // Keep all transformed vertices of the draw
+} VERTEX_CACHE;
+
+typedef struct {
+    uint32_t trivially_accepted; // Completely inside the view frustum
+    uint32_t guard_band_accepted; // Only crossing x/y planes within guard band
+    uint32_t trivially_rejected; // Completely outside of one plane
+    uint32_t clipped; // Sent to the polygon clipper
+} S3D_CLIP_STATS;
+
+typedef struct {
+    uint32_t triangles_rejected; // Counted per tile with tiled rendering
+    uint32_t blocks_rejected; // Only counted with the block rasterizer
+} S3D_HIZ_STATS;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses; // Equals to number of vertex shader invocations
+} S3D_VERTEX_CACHE_STATS;
+
+typedef enum {
+    TEX_CACHE_LRU,
+    TEX_CACHE_RANDOM
+} TEX_CACHE_REPLACEMENT;
+
+typedef struct {
+    uint32_t size; // Capacity in bytes
+    uint32_t line_size; // Power of 2
+    uint32_t ways; // size / line_size / ways sets, must be a power of 2
+    TEX_CACHE_REPLACEMENT replacement;
+} S3D_TEX_CACHE_CONFIG;
+
+typedef struct {
+    uint64_t accesses; // VRAM reads of the TMU
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t miss_bytes; // Traffic to VRAM
+} S3D_TEX_CACHE_TMU_STATS;
+
+typedef struct {
+    // Sum of all TMUs
+    uint64_t accesses;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t miss_bytes;
+    float hit_rate;
+    S3D_TEX_CACHE_TMU_STATS tmu[S3D_TMU_COUNT];
+} S3D_TEX_CACHE_STATS;
+
+// Pipeline statistics, only collected when enabled with s3d_enable_stats
+typedef struct {
+    uint64_t vertices_shaded;
+    uint64_t primitives_in; // Triangles entering setup
+    uint64_t primitives_clipped; // Sent to the polygon clipper
+    uint64_t primitives_culled; // Outside of the frustum, back facing or empty
+    uint64_t triangles_rasterized; // After clipping and culling
+    uint64_t quads_generated;
+    uint64_t quad_lanes_active; // Divide by 4 * quads for lane utilization
+    uint64_t z_passed; // Depth test, early or late
+    uint64_t z_killed;
+    uint64_t fragments_shaded;
+    uint64_t texture_samples; // Lookups, texels_fetched per sample is the filter cost
+    uint64_t texels_fetched;
+    uint64_t blocks_decoded; // Compressed texture blocks, decoded block cache misses
+    uint64_t rop_writes;
+    int32_t min_mip_level; // Larger than max_mip_level if nothing sampled
+    int32_t max_mip_level;
+    // Time spent in each stage excluding later stages, CPU time summed over
+    // all workers. Only collected with s3d_enable_stage_timing.
+    uint64_t setup_ns;
+    uint64_t rasterize_ns;
+    uint64_t fsg_ns;
+    uint64_t tmu_ns;
+} S3D_STATS;
+
+// Tracing flags
+#define S3D_TRACE_ENABLED (1u << 0) // Set while a trace is running
+#define S3D_TRACE_QUADS (1u << 1) // Add a span for every quad shaded, huge
+
+typedef struct {
+    size_t size; // VRAM size in bytes, 0 for default
+    bool huge_pages; // Ask for transparent huge pages
+    // Map VRAM from a file instead of anonymous memory, so its contents can
+    // be inspected or copied as a snapshot. Only the raw bytes are written,
+    // not allocations or objects, so the file is scratch: it is cleared when
+    // a context is created with it. NULL for anonymous.
+    const char *backing_file;
+} S3D_VRAM_CONFIG;
+
+typedef struct {
+    uint32_t used; // Including padding to allocation block sizes
+    uint32_t free;
+    uint32_t largest_free_block; // Largest allocation that could succeed
+    uint32_t allocations;
+} S3D_VRAM_STATS;
+
+// Create context with a default framebuffer, vram_config could be NULL
+S3D_CONTEXT *s3d_context_create(uint32_t width, uint32_t height,
+        S3D_VRAM_CONFIG *vram_config);
+// Destroy context, stop its workers and release its VRAM
+void s3d_context_destroy(S3D_CONTEXT *ctx);
+// Write back file backed VRAM, for snapshotting GPU memory. The snapshot can
+// not be loaded back into a context.
+void s3d_sync_vram(S3D_CONTEXT *ctx);
 // Create framebuffer
-uint32_t s3d_create_framebuffer(uint32_t width, uint32_t height, PIXEL_FORMAT format);
+uint32_t s3d_create_framebuffer(S3D_CONTEXT *ctx, uint32_t width,
+        uint32_t height, PIXEL_FORMAT format, FB_LAYOUT layout);
 // Clear color buffer
-void s3d_clear_color();
+void s3d_clear_color(S3D_CONTEXT *ctx);
 // Clear depth buffer
-void s3d_clear_depth();
+void s3d_clear_depth(S3D_CONTEXT *ctx);
+// Set color used by s3d_clear_color, in s3d_map_rgb format
+void s3d_set_clear_color(S3D_CONTEXT *ctx, uint32_t color);
+// Set depth used by s3d_clear_depth
+void s3d_set_clear_depth(S3D_CONTEXT *ctx, float depth);
+// Enable deferring clears to first access of each tile
+void s3d_fast_clear(S3D_CONTEXT *ctx, bool enable);
 // Enable depth test
-void s3d_depth_test(bool enable);
+void s3d_depth_test(S3D_CONTEXT *ctx, bool enable);
+// Enable hierarchical Z rejection of triangles and blocks
+void s3d_hierarchical_z(S3D_CONTEXT *ctx, bool enable);
+// Get hierarchical Z statistics of the last frame
+void s3d_get_hiz_stats(S3D_CONTEXT *ctx, S3D_HIZ_STATS *stats);
 // Enable face culling
-void s3d_face_culling(bool enable);
+void s3d_face_culling(S3D_CONTEXT *ctx, bool enable);
+// Enable tiled (sort-middle), multi-threaded rasterization
+void s3d_tiled_rendering(S3D_CONTEXT *ctx, bool enable);
+// Set number of worker threads used by tiled rendering
+void s3d_set_worker_count(S3D_CONTEXT *ctx, size_t count);
+// Select rasterizer implementation
+void s3d_set_rasterizer(S3D_CONTEXT *ctx, RASTERIZER rasterizer);
+// Set guard band size in pixels, limited to what the rasterizer can handle
+void s3d_set_guard_band(S3D_CONTEXT *ctx, uint32_t pixels);
+// Get triangle clipping statistics of the last frame
+void s3d_get_clip_stats(S3D_CONTEXT *ctx, S3D_CLIP_STATS *stats);
+// Select post-transform vertex cache mode, size only applies to FIFO mode
+void s3d_set_vertex_cache(S3D_CONTEXT *ctx, VERTEX_CACHE mode, size_t size);
+// Get vertex cache statistics of the last frame
+void s3d_get_vertex_cache_stats(S3D_CONTEXT *ctx,
+        S3D_VERTEX_CACHE_STATS *stats);
+// Enable collecting pipeline statistics
+void s3d_enable_stats(S3D_CONTEXT *ctx, bool enable);
+// Enable timing of pipeline stages, implies s3d_enable_stats. Timestamps are
+// taken per quad and texture lookup, so it slows rendering down noticeably.
+void s3d_enable_stage_timing(S3D_CONTEXT *ctx, bool enable);
+// Get pipeline statistics of the last frame
+void s3d_get_stats(S3D_CONTEXT *ctx, S3D_STATS *stats);
+// Model a texture cache in front of VRAM, NULL to disable
+void s3d_set_tex_cache(S3D_CONTEXT *ctx, const S3D_TEX_CACHE_CONFIG *config);
+// Get texture cache statistics of the last frame
+void s3d_get_tex_cache_stats(S3D_CONTEXT *ctx, S3D_TEX_CACHE_STATS *stats);
 // Load indices buffer into VRAM
-uint32_t s3d_load_ebo(void *buffer, size_t size);
+uint32_t s3d_load_ebo(S3D_CONTEXT *ctx, void *buffer, size_t size);
 // Load vertices buffer into VRAM
-uint32_t s3d_load_vbo(void *buffer, size_t size);
+uint32_t s3d_load_vbo(S3D_CONTEXT *ctx, void *buffer, size_t size);
 // Bind ebo and vbo to vao
-uint32_t s3d_bind_vao(uint32_t ebo_id, uint32_t vbo_id, uint32_t attr_size,
-        uint32_t attr_stride);
+uint32_t s3d_bind_vao(S3D_CONTEXT *ctx, uint32_t ebo_id, uint32_t vbo_id,
+        uint32_t attr_size, uint32_t attr_stride);
 // Load texture into VRAM
-uint32_t s3d_load_tex(void *buffer, size_t width, size_t height,
-        size_t channels, size_t byte_per_channel);
+uint32_t s3d_load_tex(S3D_CONTEXT *ctx, void *buffer, size_t width,
+        size_t height, size_t channels, size_t byte_per_channel);
+// Set memory layout of textures loaded after this call
+void s3d_set_tex_layout(S3D_CONTEXT *ctx, TEX_LAYOUT layout);
+// Set format of textures loaded after this call, compressed formats are
+// encoded when loaded and ignore the layout
+void s3d_set_tex_format(S3D_CONTEXT *ctx, TEX_FORMAT format);
 // Bind texture with TMU
-void s3d_bind_texture(uint32_t tmu, uint32_t tex_id);
+void s3d_bind_texture(S3D_CONTEXT *ctx, uint32_t tmu, uint32_t tex_id);
+// Create sampler, ID 0 is the default bilinear sampler
+uint32_t s3d_create_sampler(S3D_CONTEXT *ctx, const S3D_SAMPLER *sampler);
+// Bind sampler with TMU, it is kept when textures are bound
+void s3d_bind_sampler(S3D_CONTEXT *ctx, uint32_t tmu, uint32_t sampler_id);
+// Create shader program, ID 0 is the built-in default program
+uint32_t s3d_create_program(S3D_CONTEXT *ctx, const S3D_PROGRAM *program);
+// Bind program, also sets the varying count to the one of the program
+void s3d_use_program(S3D_CONTEXT *ctx, uint32_t program_id);
 // Update uniform
-void s3d_update_uniform(void *buffer, size_t size);
+void s3d_update_uniform(S3D_CONTEXT *ctx, void *buffer, size_t size);
+// Update part of the uniforms, starting at offset bytes
+void s3d_update_uniform_range(S3D_CONTEXT *ctx, size_t offset, void *buffer,
+        size_t size);
 // Set active varying count
-void s3d_set_varying_count(size_t count);
+void s3d_set_varying_count(S3D_CONTEXT *ctx, size_t count);
 // Render to framebuffer
-void s3d_render(uint32_t vao_id);
+void s3d_render(S3D_CONTEXT *ctx, uint32_t vao_id);
 // Render copy
-void s3d_render_copy(uint8_t *destination);
+void s3d_render_copy(S3D_CONTEXT *ctx, uint8_t *destination);
+// Replace the default framebuffer with count linear framebuffers of the same
+// size, rendered to in turn. Can only be created once per context.
+void s3d_create_swap_chain(S3D_CONTEXT *ctx, uint32_t count);
+// Finish the frame and move on to the next swap chain buffer. Returns the
+// finished image in VRAM, valid until its buffer is rendered to again,
+// count - 1 presents later.
+uint8_t *s3d_present(S3D_CONTEXT *ctx);
+// Get VRAM usage
+void s3d_get_vram_stats(S3D_CONTEXT *ctx, S3D_VRAM_STATS *stats);
 // Delete ebo from VRAM
-void s3d_delete_ebo(uint32_t ebo_id);
+void s3d_delete_ebo(S3D_CONTEXT *ctx, uint32_t ebo_id);
 // Delete vbo from VRAM
-void s3d_delete_vbo(uint32_t vbo_id);
+void s3d_delete_vbo(S3D_CONTEXT *ctx, uint32_t vbo_id);
 // Unbind vao
-void s3d_delete_vao(uint32_t vao_id);
+void s3d_delete_vao(S3D_CONTEXT *ctx, uint32_t vao_id);
 // Delete texture from VRAM
-void s3d_delete_tex(uint32_t tex_id);
+void s3d_delete_tex(S3D_CONTEXT *ctx, uint32_t tex_id);
+// Delete shader program, it stays in use until another one is bound
+void s3d_delete_program(S3D_CONTEXT *ctx, uint32_t program_id);
+// Delete sampler, it stays bound until another one is bound
+void s3d_delete_sampler(S3D_CONTEXT *ctx, uint32_t sampler_id);
+
+// Command buffers, the immediate calls above must not be used on a context
+// while it still has submitted work pending
+S3D_CMDBUF *s3d_cmdbuf_create(void);
+void s3d_cmdbuf_destroy(S3D_CMDBUF *cmdbuf);
+// Drop all recorded commands
+void s3d_cmdbuf_reset(S3D_CMDBUF *cmdbuf);
+void s3d_cmd_clear_color(S3D_CMDBUF *cmdbuf);
+void s3d_cmd_clear_depth(S3D_CMDBUF *cmdbuf);
+void s3d_cmd_bind_texture(S3D_CMDBUF *cmdbuf, uint32_t tmu, uint32_t tex_id);
+void s3d_cmd_bind_sampler(S3D_CMDBUF *cmdbuf, uint32_t tmu,
+        uint32_t sampler_id);
+// Uniforms are copied into the command buffer when recorded
+void s3d_cmd_update_uniform(S3D_CMDBUF *cmdbuf, void *buffer, size_t size);
+void s3d_cmd_update_uniform_range(S3D_CMDBUF *cmdbuf, size_t offset,
+        void *buffer, size_t size);
+void s3d_cmd_use_program(S3D_CMDBUF *cmdbuf, uint32_t program_id);
+void s3d_cmd_set_varying_count(S3D_CMDBUF *cmdbuf, size_t count);
+void s3d_cmd_render(S3D_CMDBUF *cmdbuf, uint32_t vao_id);
+// Present, destination is only valid after the fence signaled
+void s3d_cmd_render_copy(S3D_CMDBUF *cmdbuf, uint8_t *destination);
+// Swap chain present, *image is set once the fence signaled
+void s3d_cmd_present(S3D_CMDBUF *cmdbuf, uint8_t **image);
+// Queue command buffer for execution, returns its fence
+S3D_FENCE s3d_submit(S3D_CONTEXT *ctx, S3D_CMDBUF *cmdbuf);
+bool s3d_fence_signaled(S3D_CONTEXT *ctx, S3D_FENCE fence);
+void s3d_wait_fence(S3D_CONTEXT *ctx, S3D_FENCE fence);
+// Wait for everything submitted so far
+void s3d_wait_idle(S3D_CONTEXT *ctx);
+
+// Timeline tracing, process wide, written as Chrome trace JSON
+bool s3d_trace_start(const char *filename, uint32_t flags);
+void s3d_trace_stop(void);
+// Name the calling thread in the trace, name must stay valid
+void s3d_trace_thread_name(const char *name);
+// Span around a piece of work, returns 0 if not tracing. The name must be a
+// string literal, or at least outlive the trace.
+uint64_t s3d_trace_begin(void);
+void s3d_trace_end(const char *name, uint64_t start);
 
 // For C shaders, to be removed later?
 // Or keep... IDK
 // Lookup could be up to 4x32 bit wide
-VEC4 s3d_tex_lookup(uint32_t tmu_id, float dmax, VEC2 tex_coord);
+VEC4 s3d_tex_lookup(S3D_CONTEXT *ctx, uint32_t tmu_id, float dmax,
+        VEC2 tex_coord);
+// Same as s3d_tex_lookup, with the derivatives of tex_coord along x and y
+VEC4 s3d_tex_lookup_grad(S3D_CONTEXT *ctx, uint32_t tmu_id, VEC2 tex_coord,
+        VEC2 ddx, VEC2 ddy);
+// Sample all lanes of a quad at u, v. The LOD is selected once from the
+// derivatives across the quad. result is r, g, b, a.
+void s3d_tex_lookup_quad(S3D_CONTEXT *ctx, uint32_t tmu_id, const bool *masks,
+        FS_LANES u, FS_LANES v, FS_LANES *result);
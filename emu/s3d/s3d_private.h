@@ -22,15 +22,46 @@
 //
 #pragma once
 
+#include <time.h>
+
 #define MIN(a, b) (a < b) ? (a) : (b)
 #define MAX(a, b) (a > b) ? (a) : (b)
 
 #define MAX_TEXTURE_SIZE (512)
+#define BC_CACHE_ENTRIES (16) // Decoded blocks per worker and TMU, 4x4 blocks
 
-#define VRAM_SIZE (256 * 1024 * 1024)
+#define VRAM_SIZE (256 * 1024 * 1024) // Default VRAM size
+#define MAX_VRAM_SIZE (2048u * 1024 * 1024)
+#define VRAM_ALIGNMENT (64) // Default alignment of VRAM allocations
 #define UNIFORM_SIZE (4 * 128)
 #define MAX_VARYING (32) // Maximum num of floats, 32 means 8 vec4
-#define TMU_COUNT (1)
+#define TMU_COUNT (S3D_TMU_COUNT)
+
+// Tiled rendering: screen is divided into TILE_SIZE x TILE_SIZE tiles, each
+// tile is rasterized and shaded by a single worker. Must be a multiple of 2
+// so a 2x2 quad never straddles 2 tiles.
+#define TILE_SIZE (32)
+#define MAX_WORKERS (64)
+#define MAX_SWAP_CHAIN (4)
+// Top level block size for the block rasterizer, TILE_SIZE must be a
+// multiple of this.
+#define BLOCK_SIZE (16)
+// Hierarchical Z tile size, TILE_SIZE must be a multiple of this.
+#define HIZ_TILE_SIZE (8)
+
+// Fast clear flags, per TILE_SIZE x TILE_SIZE tile
+#define CLEAR_COLOR (0x01)
+#define CLEAR_DEPTH (0x02)
+
+// Edge functions are evaluated with int32_t, as the sum of 2 products of
+// screen coordinate differences. This limits the span of screen coordinates
+// (framebuffer plus guard band on both sides), with some headroom left for
+// stepping.
+#define MAX_SCREEN_EXTENT (32000)
+#define DEFAULT_GUARD_BAND (8192)
+
+#define MAX_VERTEX_CACHE_SIZE (64)
+#define DEFAULT_VERTEX_CACHE_SIZE (32)
 
 #define READER_COUNTER (2)
 // 2-reader in the system:
@@ -58,12 +89,24 @@ typedef struct {
     uint32_t size;
 } EBO;
 
+typedef struct {
+    float max_depth; // Farthest depth in the tile
+    bool dirty; // Depth buffer written since max_depth was computed
+} HIZ_TILE;
+
 typedef struct {
     uint32_t color_address;
     uint32_t depth_address;
+    uint32_t hiz_address;
+    uint32_t clear_address; // Fast clear flags
+    uint32_t clear_color; // Clear values of the last clear
+    float clear_depth;
     uint32_t width;
     uint32_t height;
-    uint32_t size;
+    uint32_t size; // Size of the color buffer in linear layout
+    FB_LAYOUT layout;
+    uint32_t tile_shift; // log2 of micro-tile size, 0 for linear
+    uint32_t tiles_x; // Number of micro-tiles per row
 } FBO;
 
 typedef struct {
@@ -71,6 +114,8 @@ typedef struct {
     uint32_t width;
     uint32_t height;
     uint32_t mipmap_levels;
+    TEX_LAYOUT layout;
+    TEX_FORMAT format;
 } TEX;
 
 typedef struct {
@@ -79,9 +124,65 @@ typedef struct {
     uint16_t width;
     uint16_t height;
     uint8_t mipmap_levels;
+    TEX_LAYOUT layout;
+    TEX_FORMAT format;
+    S3D_SAMPLER sampler;
 } TMU;
 
 typedef struct {
+    int32_t x0;
+    int32_t y0;
+    int32_t x1; // Exclusive
+    int32_t y1; // Exclusive
+} S3D_RECT;
+
+typedef struct S3D_TILER S3D_TILER;
+typedef struct S3D_POOL S3D_POOL;
+typedef struct S3D_QUEUE S3D_QUEUE;
+typedef struct S3D_VRAM_ALLOCATOR S3D_VRAM_ALLOCATOR;
+typedef struct S3D_TEX_CACHE S3D_TEX_CACHE;
+typedef struct S3D_BC_CACHE S3D_BC_CACHE;
+typedef void (*POOL_JOB)(void *arg, uint32_t index);
+typedef struct SETUP_TRIANGLE SETUP_TRIANGLE;
+// Fragment pipeline specialized for a combination of states
+typedef void (*QUAD_KERNEL)(S3D_CONTEXT *ctx, bool *masks, int32_t x,
+        int32_t y, SETUP_TRIANGLE *tri);
+
+typedef struct {
+    // TODO: Keep these as a union... if that ever matters
+    VEC4 position; // Not kept after rasterization step, only for clipping
+    int32_t screen_position[4];
+    float varying[MAX_VARYING - 4];
+} POST_VS_VERTEX;
+
+typedef struct {
+    float *attributes;
+    uint32_t attribute_stride;
+    uint32_t vertex_count;
+    // FIFO mode
+    uint32_t fifo_tags[MAX_VERTEX_CACHE_SIZE];
+    POST_VS_VERTEX fifo[MAX_VERTEX_CACHE_SIZE];
+    uint32_t fifo_head;
+    // Full mode
+    POST_VS_VERTEX *vertices;
+    uint32_t *stamps;
+    uint32_t *unique; // Unique indices of the current draw
+    uint32_t unique_count;
+    uint32_t capacity;
+    uint32_t generation;
+} VERTEX_CACHE_STATE;
+
+// Inclusive time of each stage, later stages are subtracted when the frame
+// ends. Setup only includes rasterization in immediate (non-tiled) mode.
+typedef struct {
+    uint64_t setup;
+    uint64_t setup_rasterize; // Rasterization called from setup
+    uint64_t rasterize;
+    uint64_t fsg;
+    uint64_t tmu;
+} S3D_STAGE_TIME;
+
+struct S3D_CONTEXT {
     /* Driver states */
     // Objects
     RESIZABLE_ARRAY vao;
@@ -89,47 +190,241 @@ typedef struct {
     RESIZABLE_ARRAY ebo;
     RESIZABLE_ARRAY fbo;
     RESIZABLE_ARRAY tex;
-    uint32_t memptr;
+    RESIZABLE_ARRAY program;
+    RESIZABLE_ARRAY sampler;
+    // IDs of deleted objects, reused by the next object created
+    RESIZABLE_ARRAY vao_free;
+    RESIZABLE_ARRAY vbo_free;
+    RESIZABLE_ARRAY ebo_free;
+    RESIZABLE_ARRAY tex_free;
+    RESIZABLE_ARRAY program_free;
+    RESIZABLE_ARRAY sampler_free;
+    S3D_VRAM_ALLOCATOR *vram_allocator;
     uint32_t active_fbo;
+    uint32_t swap_chain[MAX_SWAP_CHAIN]; // FBO IDs
+    uint32_t swap_chain_length;
+    uint32_t back_buffer; // Swap chain index of the active FBO
     uint32_t varying_count;
+    S3D_PROGRAM active_program; // Copy, so it survives deletion
+    QUAD_KERNEL quad_kernel; // Selected at the start of every draw
+
+    // Tiled rendering
+    bool tiled_rendering;
+    uint32_t worker_count;
+    S3D_POOL *pool;
+    S3D_TILER *tiler;
+
+    // Command submission
+    S3D_QUEUE *queue;
 
     /* Hardware states */
-    uint8_t vram[VRAM_SIZE];
+    uint8_t *vram; // Memory mapped, committed on first touch
+    size_t vram_size;
+    int vram_fd;
     uint8_t uniforms[UNIFORM_SIZE];
     uint8_t shared[READER_COUNTER][SHARED_SIZE];
 
     TMU tmu[TMU_COUNT];
+    // Texture cache model, one per worker and TMU, NULL if disabled
+    S3D_TEX_CACHE *tex_cache;
+    S3D_TEX_CACHE_CONFIG tex_cache_config;
+    uint32_t tex_cache_sets;
+    uint32_t tex_cache_line_shift;
+    S3D_TEX_CACHE_STATS last_tex_cache_stats;
+    // Decoded block cache, one per worker and TMU
+    S3D_BC_CACHE *bc_cache;
 
     // Pipeline configs
     bool depth_test;
     bool early_depth_test;
+    bool hiz;
+    bool fast_clear;
+    uint32_t clear_color;
+    float clear_depth;
     bool face_culling;
     bool perspective_correct;
-} S3D_CONTEXT;
+    RASTERIZER rasterizer;
+    TEX_LAYOUT tex_layout; // For newly loaded textures
+    TEX_FORMAT tex_format;
+    uint32_t guard_band;
+    VERTEX_CACHE vertex_cache;
+    uint32_t vertex_cache_size;
+    VERTEX_CACHE_STATE vertex_cache_state;
+
+    // Statistics
+    S3D_CLIP_STATS clip_stats;
+    S3D_CLIP_STATS last_clip_stats;
+    S3D_HIZ_STATS hiz_stats;
+    S3D_HIZ_STATS last_hiz_stats;
+    S3D_VERTEX_CACHE_STATS vertex_cache_stats;
+    S3D_VERTEX_CACHE_STATS last_vertex_cache_stats;
+    bool stats_enabled;
+    bool stage_timing;
+    S3D_STATS stats;
+    S3D_STATS last_stats;
+    S3D_STAGE_TIME stage_time;
+};
 
+// Attribute plane equation, anchored at the first vertex of the triangle:
+// A(x, y) = a0 + dadx * (x - x[0]) + dady * (y - y[0])
 typedef struct {
-    // TODO: Keep these as a union... if that ever matters
-    VEC4 position; // Not kept after rasterization step, only for clipping
-    int32_t screen_position[4];
-    float varying[MAX_VARYING - 4];
-} POST_VS_VERTEX;
+    float a0;
+    float dadx;
+    float dady;
+} PLANE;
+
+// Output of triangle setup, everything needed for rasterization and
+// fragment interpolation
+struct SETUP_TRIANGLE {
+    int32_t x[3];
+    int32_t y[3];
+    PLANE z;
+    PLANE w_inverse;
+    PLANE varying[MAX_VARYING - 4]; // Varying over w
+};
+
+// Statistics could be updated from several tile workers at once
+#define S3D_STAT_ADD(counter, value) \
+        __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+
+// Nanoseconds, for stage timing
+static inline uint64_t s3d_timestamp(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+extern uint32_t s3d_trace_flags;
+
+// Start a span if any of the trace flags are set, end with s3d_trace_end
+static inline uint64_t s3d_trace_span_begin(uint32_t flags) {
+    if (!(__atomic_load_n(&s3d_trace_flags, __ATOMIC_RELAXED) & flags))
+        return 0;
+    return s3d_timestamp();
+}
+
+// Spread the lower 16 bits of x to the even bits
+static inline uint32_t s3d_part1by1(uint32_t x) {
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// Interleave bits of x and y
+static inline uint32_t s3d_morton_encode(uint32_t x, uint32_t y) {
+    return s3d_part1by1(x) | (s3d_part1by1(y) << 1);
+}
+
+// Byte offset of a level in a Morton layout texture, level 0 is 1x1 and is
+// stored last
+static inline uint32_t s3d_morton_level_offset(uint32_t levels,
+        int32_t level) {
+    // Sum of 4 * 4^k for k in (level, levels]
+    return 4 * ((4u << (2 * levels)) - (4u << (2 * level))) / 3;
+}
+
+static inline uint32_t s3d_bc_block_size(TEX_FORMAT format) {
+    return (format == TEX_FORMAT_BC1) ? 8 : 16;
+}
 
-extern S3D_CONTEXT s3d_context;
+// Block offset of a level in a block compressed texture, level 0 is 1x1 and
+// is stored last. Levels smaller than 4x4 take one block each.
+static inline uint32_t s3d_bc_level_offset(uint32_t levels, uint32_t level) {
+    if (levels < 2)
+        return levels - level;
+    uint32_t full = (level > 2) ? level : 2;
+    // Sum of 4^(k-2) for k in (full, levels], plus the small levels
+    return ((1u << (2 * levels - 2)) - (1u << (2 * full - 2))) / 3 +
+            (full - level);
+}
+
+// Get pixel index within color/ depth buffer
+static inline uint32_t s3d_pixel_index(const FBO *fbo, int32_t x, int32_t y) {
+    if (fbo->layout == FB_LAYOUT_LINEAR)
+        return y * fbo->width + x;
+    uint32_t shift = fbo->tile_shift;
+    uint32_t mask = (1u << shift) - 1;
+    uint32_t tile = (y >> shift) * fbo->tiles_x + (x >> shift);
+    return (tile << (shift * 2)) | ((y & mask) << shift) | (x & mask);
+}
 
 float float_lerp(float factor, float r1, float r2);
 VEC3 vec3_lerp(float factor, VEC3 r1, VEC3 r2);
 void swap(int *a, int *b);
 
 uint32_t s3d_map_rgb(uint8_t r, uint8_t g, uint8_t b);
-void s3d_set_pixel(FBO *fbo, int32_t x, int32_t y, uint32_t color);
-void s3d_xline(FBO *fbo, int32_t x0, int32_t y0, int32_t x1, uint32_t color);
-void s3d_yline(FBO *fbo, int32_t x0, int32_t y0, int32_t y1, uint32_t color);
-void s3d_line(FBO *fbo, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t color);
-
-void s3d_process_fragments(bool* masks, int32_t x, int32_t y, int32_t *w0,
-        int32_t *w1, int32_t *w2, POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
-        POST_VS_VERTEX *v2);
-void s3d_rasterize_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
-        POST_VS_VERTEX *v2);
-void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
-        POST_VS_VERTEX *v2);
+void s3d_set_pixel(S3D_CONTEXT *ctx, FBO *fbo, int32_t x, int32_t y, uint32_t color);
+void s3d_xline(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0, int32_t x1, uint32_t color);
+void s3d_yline(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0, int32_t y1, uint32_t color);
+void s3d_line(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t color);
+
+void s3d_select_quad_kernel(S3D_CONTEXT *ctx);
+void s3d_process_fragments(S3D_CONTEXT *ctx, bool* masks, int32_t x,
+        int32_t y, SETUP_TRIANGLE *tri);
+void s3d_rasterize_triangle(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri,
+        S3D_RECT *rect);
+void s3d_setup_triangle(S3D_CONTEXT *ctx, POST_VS_VERTEX *v0,
+        POST_VS_VERTEX *v1, POST_VS_VERTEX *v2);
+
+typedef uint32_t (*COVERAGE_FUNC)(const int32_t *edge, const int32_t *step_x,
+        const int32_t *step_y);
+extern COVERAGE_FUNC s3d_coverage_quad;
+extern COVERAGE_FUNC s3d_coverage_4x2;
+void s3d_coverage_init(void);
+
+void s3d_vertex_cache_begin(S3D_CONTEXT *ctx, float *attributes,
+        uint32_t attribute_stride, uint32_t vertex_count, uint32_t *indices,
+        uint32_t index_count);
+POST_VS_VERTEX *s3d_vertex_cache_fetch(S3D_CONTEXT *ctx, uint32_t index,
+        POST_VS_VERTEX *vertex);
+void s3d_vertex_cache_deinit(S3D_CONTEXT *ctx);
+
+void s3d_vram_init(S3D_CONTEXT *ctx, S3D_VRAM_CONFIG *config);
+void s3d_vram_deinit(S3D_CONTEXT *ctx);
+uint32_t s3d_malloc(S3D_CONTEXT *ctx, uint32_t size, uint32_t alignment);
+void s3d_free(S3D_CONTEXT *ctx, uint32_t address);
+
+uint32_t s3d_hiz_size(uint32_t width, uint32_t height);
+void s3d_hiz_clear(S3D_CONTEXT *ctx, FBO *fbo, float depth);
+void s3d_hiz_mark(S3D_CONTEXT *ctx, FBO *fbo, int32_t x, int32_t y);
+bool s3d_hiz_reject(S3D_CONTEXT *ctx, FBO *fbo, int32_t x0, int32_t y0,
+        int32_t x1, int32_t y1, float min_depth);
+
+uint32_t s3d_clear_flags_size(uint32_t width, uint32_t height);
+void s3d_clear_tiles(S3D_CONTEXT *ctx, FBO *fbo, uint8_t flags);
+void s3d_resolve_pixel(S3D_CONTEXT *ctx, FBO *fbo, int32_t x, int32_t y);
+void s3d_resolve_tiles(S3D_CONTEXT *ctx, FBO *fbo, uint8_t mask);
+
+void s3d_pool_init(S3D_CONTEXT *ctx);
+void s3d_pool_deinit(S3D_CONTEXT *ctx);
+void s3d_pool_run(S3D_CONTEXT *ctx, POOL_JOB job, void *arg, uint32_t count);
+// 0 outside of pool worker threads
+uint32_t s3d_worker_id(void);
+
+void s3d_tiler_init(S3D_CONTEXT *ctx);
+void s3d_tiler_deinit(S3D_CONTEXT *ctx);
+void s3d_bin_triangle(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri);
+void s3d_tiler_flush(S3D_CONTEXT *ctx);
+
+void s3d_tex_cache_deinit(S3D_CONTEXT *ctx);
+void s3d_tex_cache_invalidate(S3D_CONTEXT *ctx);
+S3D_TEX_CACHE *s3d_tex_cache_get(S3D_CONTEXT *ctx, uint32_t tmu_id);
+void s3d_tex_cache_access(S3D_CONTEXT *ctx, S3D_TEX_CACHE *cache,
+        uint32_t address);
+void s3d_tex_cache_end_frame(S3D_CONTEXT *ctx);
+
+void s3d_bc_init(S3D_CONTEXT *ctx);
+void s3d_bc_deinit(S3D_CONTEXT *ctx);
+void s3d_bc_invalidate(S3D_CONTEXT *ctx);
+void s3d_bc_encode_level(TEX_FORMAT format, const uint8_t *image,
+        uint32_t side, uint32_t channels, uint8_t *target);
+S3D_BC_CACHE *s3d_bc_cache_get(S3D_CONTEXT *ctx, uint32_t tmu_id);
+void s3d_bc_fetch(S3D_CONTEXT *ctx, S3D_TEX_CACHE *cache,
+        S3D_BC_CACHE *bc_cache, TMU *tmu, uint32_t level, uint32_t x,
+        uint32_t y, uint8_t *rgba);
+
+void s3d_queue_init(S3D_CONTEXT *ctx);
+void s3d_queue_deinit(S3D_CONTEXT *ctx);
@@ -29,6 +29,19 @@
 #include "utils.h"
 #include "s3d_private.h"
 
+// Clipping edges, vertex is inside if dot(vertex + w_bias, edge) > 0
+static const VEC4 clipping_edges[7] = {
+    {-1.f,  0.f,  0.f,  1.f}, // 0 x = +w
+    { 1.f,  0.f,  0.f,  1.f}, // 1 x = -w
+    { 0.f, -1.f,  0.f,  1.f}, // 2 y = +w
+    { 0.f,  1.f,  0.f,  1.f}, // 3 y = -w
+    { 0.f,  0.f,  1.f,  0.f}, // 4 z = 0
+    { 0.f,  0.f,  1.f,  1.f}, // 5 z = -w
+    { 0.f,  0.f,  0.f,  1.f}, // 6 w = epsilon // this needs bias
+};
+#define CLIP_XY_EDGES (0x0f)
+#define CLIP_W_BIAS (0.1f)
+
 // TODO: Add bias
 static float vec4_dot_w_bias(VEC4 *r1, VEC4 *r2, float w_bias) {
     return r1->x * r2->x +
@@ -41,25 +54,136 @@ static bool is_vertex_inside_edge(VEC4 *edge, VEC4 *vertex, float w_bias) {
     return (vec4_dot_w_bias(vertex, edge, w_bias) > 0.0f);
 }
 
-static POST_VS_VERTEX get_intersection(VEC4 *edge, POST_VS_VERTEX *v0,
-        POST_VS_VERTEX *v1, float w_bias) {
+// Bit i is set if the vertex is outside of clipping edge i. x and y edges
+// are scaled to cover the given guard band (1.0 means no guard band).
+static uint32_t get_outcode(VEC4 *vertex, float scale_x, float scale_y) {
+    uint32_t outcode = 0;
+    for (int i = 0; i < 7; i++) {
+        VEC4 edge = clipping_edges[i];
+        float bias = (i == 6) ? CLIP_W_BIAS : 0.0f;
+        if (i < 2)
+            edge.w *= scale_x;
+        else if (i < 4)
+            edge.w *= scale_y;
+        if (!is_vertex_inside_edge(&edge, vertex, bias))
+            outcode |= 1u << i;
+    }
+    return outcode;
+}
+
+// Guard band size in pixels that's safe for the current configuration
+static uint32_t get_guard_band(S3D_CONTEXT *ctx, FBO *fbo) {
+    uint32_t size = MAX(fbo->width, fbo->height);
+    uint32_t limit = (MAX_SCREEN_EXTENT - size) / 2;
+    return MIN(ctx->guard_band, limit);
+}
+
+static POST_VS_VERTEX get_intersection(S3D_CONTEXT *ctx, VEC4 *edge,
+        POST_VS_VERTEX *v0, POST_VS_VERTEX *v1, float w_bias) {
     float dp = vec4_dot_w_bias(&v0->position, edge, w_bias);
     float dp_prev = vec4_dot_w_bias(&v1->position, edge, w_bias);
     float factor = dp_prev / (dp_prev - dp);
     POST_VS_VERTEX result;
     result.position = vec4_lerp(factor, v0->position, v1->position);
-    for (int i = 0; i < s3d_context.varying_count; i++)
+    for (int i = 0; i < ctx->varying_count; i++)
         result.varying[i] = float_lerp(factor, v0->varying[i], v1->varying[i]);
     return result;
 }
 
-void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
+static void s3d_setup_plane(PLANE *plane, float a0, float a1, float a2,
+        float gx1, float gy1, float gx2, float gy2) {
+    plane->a0 = a0;
+    plane->dadx = (a1 - a0) * gx1 + (a2 - a0) * gx2;
+    plane->dady = (a1 - a0) * gy1 + (a2 - a0) * gy2;
+}
+
+// Compute plane equations of all interpolated attributes, so the fragment
+// stage only needs to evaluate them instead of doing barycentric
+// interpolation per pixel.
+// Return false if the triangle is degenerated or back facing, which the
+// rasterizer would reject anyway.
+static bool s3d_setup_planes(S3D_CONTEXT *ctx, SETUP_TRIANGLE *tri,
+        POST_VS_VERTEX *v0, POST_VS_VERTEX *v1, POST_VS_VERTEX *v2) {
+    int32_t x0 = v0->screen_position[0];
+    int32_t y0 = v0->screen_position[1];
+    int32_t x1 = v1->screen_position[0];
+    int32_t y1 = v1->screen_position[1];
+    int32_t x2 = v2->screen_position[0];
+    int32_t y2 = v2->screen_position[1];
+
+    // Twice the signed area, same as the edge function of 0 and 1 evaluated
+    // at vertex 2 in the rasterizer
+    int32_t area = (x2 - x1) * (y0 - y1) + (y2 - y1) * (x1 - x0);
+    if (area <= 0)
+        return false;
+
+    tri->x[0] = x0;
+    tri->y[0] = y0;
+    tri->x[1] = x1;
+    tri->y[1] = y1;
+    tri->x[2] = x2;
+    tri->y[2] = y2;
+
+    // Gradient of the barycentric weights of vertex 1 and 2
+    float inv_area = 1.0f / (float)area;
+    float gx1 = (float)(y2 - y0) * inv_area;
+    float gy1 = (float)(x0 - x2) * inv_area;
+    float gx2 = (float)(y0 - y1) * inv_area;
+    float gy2 = (float)(x1 - x0) * inv_area;
+
+    s3d_setup_plane(&tri->z, v0->position.z, v1->position.z, v2->position.z,
+            gx1, gy1, gx2, gy2);
+    s3d_setup_plane(&tri->w_inverse, v0->position.w, v1->position.w,
+            v2->position.w, gx1, gy1, gx2, gy2);
+    for (uint32_t i = 0; i < ctx->varying_count; i++) {
+        s3d_setup_plane(&tri->varying[i], v0->varying[i], v1->varying[i],
+                v2->varying[i], gx1, gy1, gx2, gy2);
+    }
+    return true;
+}
+
+void s3d_setup_triangle(S3D_CONTEXT *ctx, POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
         POST_VS_VERTEX *v2) {
     // For current resolution
-    FBO fbo = ((FBO *)s3d_context.fbo.buf)[s3d_context.active_fbo];
+    FBO fbo = ((FBO *)ctx->fbo.buf)[ctx->active_fbo];
+
+    // Outcodes against the view frustum and the guard band. Triangles
+    // completely outside of one edge are rejected. The rasterizer takes care
+    // of anything within the guard band, so only triangles crossing near/ far/
+    // w planes, or going beyond the guard band needs to be clipped.
+    uint32_t guard_band = get_guard_band(ctx, &fbo);
+    float scale_x = 1.0f + 2.0f * guard_band / fbo.width;
+    float scale_y = 1.0f + 2.0f * guard_band / fbo.height;
+    uint32_t outcode[3] = {
+        get_outcode(&v0->position, 1.0f, 1.0f),
+        get_outcode(&v1->position, 1.0f, 1.0f),
+        get_outcode(&v2->position, 1.0f, 1.0f)
+    };
+    if (outcode[0] & outcode[1] & outcode[2]) {
+        ctx->clip_stats.trivially_rejected++;
+        return;
+    }
+    uint32_t clip_edges = (outcode[0] | outcode[1] | outcode[2]);
+    if (guard_band != 0) {
+        uint32_t guard_outcode =
+                get_outcode(&v0->position, scale_x, scale_y) |
+                get_outcode(&v1->position, scale_x, scale_y) |
+                get_outcode(&v2->position, scale_x, scale_y);
+        clip_edges = (clip_edges & ~CLIP_XY_EDGES) |
+                (guard_outcode & CLIP_XY_EDGES);
+    }
+    if (clip_edges != 0)
+        ctx->clip_stats.clipped++;
+    else if (outcode[0] | outcode[1] | outcode[2])
+        ctx->clip_stats.guard_band_accepted++;
+    else
+        ctx->clip_stats.trivially_accepted++;
 
-    POST_VS_VERTEX position_a[9] = {0};
-    POST_VS_VERTEX position_b[9] = {0};
+    // Triangles may extend into the guard band, only rasterize on screen
+    S3D_RECT screen = {0, 0, fbo.width, fbo.height};
+
+    POST_VS_VERTEX position_a[9];
+    POST_VS_VERTEX position_b[9];
     position_a[0] = *v0;
     position_a[1] = *v1;
     position_a[2] = *v2;
@@ -68,26 +192,16 @@ void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
     // Otherwise, triangles that's partially visible won't be rendered correctly
     // Each clipping plane introduces up to 1 new vertex to the polygon.
     // Starting with a triangle, and may ended up getting 9 vertices
-    uint32_t polygon_count;
-    VEC4 clipping_edges[7] = {
-        {-1.f,  0.f,  0.f,  1.f}, // 0 x = +w
-        { 1.f,  0.f,  0.f,  1.f}, // 1 x = -w
-        { 0.f, -1.f,  0.f,  1.f}, // 2 y = +w
-        { 0.f,  1.f,  0.f,  1.f}, // 3 y = -w
-        { 0.f,  0.f,  1.f,  0.f}, // 4 z = 0
-        { 0.f,  0.f,  1.f,  1.f}, // 5 z = -w
-        { 0.f,  0.f,  0.f,  1.f}, // 6 w = epsilon // this needs bias
-    };
-
-    uint32_t bias_u = 0x1;
-    float min_bias = *(float *)(&bias_u);
-
+    // Edges no vertex is outside of are skipped, they won't change anything.
     POST_VS_VERTEX *p_input_position = position_b;
     int input_count = 0;
     POST_VS_VERTEX *p_output_position = position_a;
     int output_count = 3;
     for (int i = 0; i < 7; i++) {
-        float bias = (i == 6) ? 0.1f : 0.0f;
+        if (!(clip_edges & (1u << i)))
+            continue;
+        VEC4 edge = clipping_edges[i];
+        float bias = (i == 6) ? CLIP_W_BIAS : 0.0f;
 
         // Clip
         // Output from last iteration become input of this iteration
@@ -111,17 +225,17 @@ void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
         // TODO: Optimize this. This would ended up being in the GPU
         POST_VS_VERTEX* reference_vertex = &p_input_position[input_count - 1];
         for (int j = 0; j < input_count; j++) {
-            if (is_vertex_inside_edge(&clipping_edges[i], &p_input_position[j].position, bias)) {
-                if (!is_vertex_inside_edge(&clipping_edges[i], &reference_vertex->position, bias)) {
+            if (is_vertex_inside_edge(&edge, &p_input_position[j].position, bias)) {
+                if (!is_vertex_inside_edge(&edge, &reference_vertex->position, bias)) {
                     p_output_position[output_count++] =
-                            get_intersection(&clipping_edges[i],
+                            get_intersection(ctx, &edge,
                             &p_input_position[j], reference_vertex, bias);
                 }
                 p_output_position[output_count++] = p_input_position[j];
             }
-            else if (is_vertex_inside_edge(&clipping_edges[i], &reference_vertex->position, bias)) {
+            else if (is_vertex_inside_edge(&edge, &reference_vertex->position, bias)) {
                 p_output_position[output_count++] =
-                        get_intersection(&clipping_edges[i],
+                        get_intersection(ctx, &edge,
                         &p_input_position[j], reference_vertex, bias);
             }
             reference_vertex = &p_input_position[j];
@@ -141,13 +255,14 @@ void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
         p_output_position[j].position.y = (1.0f - p_output_position[j].position.y * inv_w) * fbo.height / 2;
         p_output_position[j].position.z = (p_output_position[j].position.z * inv_w);
         p_output_position[j].position.w = inv_w;
-        for (int k = 0; k < s3d_context.varying_count; k++) {
+        for (int k = 0; k < ctx->varying_count; k++) {
             p_output_position[j].varying[k] *= inv_w;
         }
     }
     for (int j = 0; j < output_count; j++) {
-        p_output_position[j].screen_position[0] = (int32_t)(p_output_position[j].position.x + 0.5);
-        p_output_position[j].screen_position[1] = (int32_t)(p_output_position[j].position.y + 0.5);
+        // Round to nearest, vertices in guard band could be negative
+        p_output_position[j].screen_position[0] = (int32_t)floor(p_output_position[j].position.x + 0.5);
+        p_output_position[j].screen_position[1] = (int32_t)floor(p_output_position[j].position.y + 0.5);
     }
     // END OF VS STAGE
 
@@ -159,6 +274,7 @@ void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
 
     // ISSUE: I have a polygon here... how to select the right edges to produce an triangle?
 
+    uint32_t emitted = 0;
     for (int i = 0; i < output_count - 2; i++) {
         //if (i == 0) continue;
 
@@ -186,10 +302,17 @@ void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
 #endif
 
         // Rasterization:
-        s3d_rasterize_triangle(
+        SETUP_TRIANGLE tri;
+        if (!s3d_setup_planes(ctx, &tri,
                 &p_output_position[0],
                 &p_output_position[i + 2],
-                &p_output_position[i + 1]);
+                &p_output_position[i + 1]))
+            continue;
+        if (ctx->tiled_rendering)
+            s3d_bin_triangle(ctx, &tri);
+        else
+            s3d_rasterize_triangle(ctx, &tri, &screen);
+        emitted++;
 #if 0
         int32_t pos0x = p_output_position[0].screen_position[0];
         int32_t pos0y = p_output_position[0].screen_position[1];
@@ -202,4 +325,11 @@ void s3d_setup_triangle(POST_VS_VERTEX *v0, POST_VS_VERTEX *v1,
         s3d_line(&fbo, pos2x, pos2y, pos0x, pos0y, 0xff0000ff);
 #endif
     }
+
+    // Back facing, empty or clipped away
+    if (ctx->stats_enabled) {
+        ctx->stats.triangles_rasterized += emitted;
+        if (emitted == 0)
+            ctx->stats.primitives_culled++;
+    }
 }
\ No newline at end of file
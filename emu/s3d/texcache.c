@@ -0,0 +1,202 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Texture cache model
+// A set-associative cache in front of texture reads from VRAM. Only tags are
+// kept, texel data is still read from VRAM, so the model never changes what
+// is rendered. Every worker has its own caches, like every shader core would
+// have its own TMUs, so results with tiled rendering depend on how tiles get
+// distributed. Caches keep their contents across frames, and are invalidated
+// when textures are loaded or deleted.
+
+#define CACHE_LINE_SIZE (64)
+
+// Updated on every access, keep caches of different workers on different
+// host cache lines
+struct S3D_TEX_CACHE {
+    uint32_t *tags; // sets * ways, INVALID_TAG if empty
+    uint32_t *stamps; // Last access, for LRU
+    uint32_t clock;
+    uint32_t random;
+    S3D_TEX_CACHE_TMU_STATS stats;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define INVALID_TAG (0xffffffffu)
+
+static bool is_power_of_2(uint32_t x) {
+    return (x != 0) && ((x & (x - 1)) == 0);
+}
+
+static uint32_t log2_int(uint32_t x) {
+    uint32_t result = 0;
+    while (x >>= 1)
+        result++;
+    return result;
+}
+
+static void s3d_tex_cache_free(S3D_CONTEXT *ctx) {
+    if (!ctx->tex_cache)
+        return;
+    for (uint32_t i = 0; i < MAX_WORKERS * TMU_COUNT; i++) {
+        free(ctx->tex_cache[i].tags);
+        free(ctx->tex_cache[i].stamps);
+    }
+    free(ctx->tex_cache);
+    ctx->tex_cache = NULL;
+}
+
+void s3d_set_tex_cache(S3D_CONTEXT *ctx, const S3D_TEX_CACHE_CONFIG *config) {
+    s3d_tex_cache_free(ctx);
+    memset(&ctx->last_tex_cache_stats, 0, sizeof(S3D_TEX_CACHE_STATS));
+    if (!config)
+        return;
+
+    assert(is_power_of_2(config->line_size));
+    assert(config->ways != 0);
+    uint32_t sets = config->size / config->line_size / config->ways;
+    assert(is_power_of_2(sets));
+    ctx->tex_cache_config = *config;
+    ctx->tex_cache_line_shift = log2_int(config->line_size);
+    ctx->tex_cache_sets = sets;
+
+    // Allocated for every possible worker, most would never be touched
+    size_t caches_size = MAX_WORKERS * TMU_COUNT * sizeof(S3D_TEX_CACHE);
+    int result = posix_memalign((void **)&ctx->tex_cache, CACHE_LINE_SIZE,
+            caches_size);
+    assert(result == 0);
+    memset(ctx->tex_cache, 0, caches_size);
+    for (uint32_t i = 0; i < MAX_WORKERS * TMU_COUNT; i++) {
+        S3D_TEX_CACHE *cache = &ctx->tex_cache[i];
+        cache->tags = malloc(sets * config->ways * sizeof(uint32_t));
+        cache->stamps = calloc(sets * config->ways, sizeof(uint32_t));
+        assert(cache->tags);
+        assert(cache->stamps);
+        memset(cache->tags, 0xff, sets * config->ways * sizeof(uint32_t));
+        cache->random = 0x12345678u + i;
+    }
+}
+
+void s3d_tex_cache_deinit(S3D_CONTEXT *ctx) {
+    s3d_tex_cache_free(ctx);
+}
+
+void s3d_tex_cache_invalidate(S3D_CONTEXT *ctx) {
+    if (!ctx->tex_cache)
+        return;
+    uint32_t lines = ctx->tex_cache_sets * ctx->tex_cache_config.ways;
+    for (uint32_t i = 0; i < MAX_WORKERS * TMU_COUNT; i++)
+        memset(ctx->tex_cache[i].tags, 0xff, lines * sizeof(uint32_t));
+}
+
+S3D_TEX_CACHE *s3d_tex_cache_get(S3D_CONTEXT *ctx, uint32_t tmu_id) {
+    if (!ctx->tex_cache)
+        return NULL;
+    return &ctx->tex_cache[s3d_worker_id() * TMU_COUNT + tmu_id];
+}
+
+void s3d_tex_cache_access(S3D_CONTEXT *ctx, S3D_TEX_CACHE *cache,
+        uint32_t address) {
+    uint32_t ways = ctx->tex_cache_config.ways;
+    uint32_t line = address >> ctx->tex_cache_line_shift;
+    uint32_t set = line & (ctx->tex_cache_sets - 1);
+    uint32_t *tags = &cache->tags[set * ways];
+    uint32_t *stamps = &cache->stamps[set * ways];
+
+    cache->clock++;
+    cache->stats.accesses++;
+    for (uint32_t i = 0; i < ways; i++) {
+        if (tags[i] == line) {
+            stamps[i] = cache->clock;
+            cache->stats.hits++;
+            return;
+        }
+    }
+
+    // Miss, fill an empty way if there is one
+    uint32_t victim = 0;
+    for (victim = 0; victim < ways; victim++) {
+        if (tags[victim] == INVALID_TAG)
+            break;
+    }
+    if (victim == ways) {
+        if (ctx->tex_cache_config.replacement == TEX_CACHE_RANDOM) {
+            // xorshift32
+            cache->random ^= cache->random << 13;
+            cache->random ^= cache->random >> 17;
+            cache->random ^= cache->random << 5;
+            victim = cache->random % ways;
+        }
+        else {
+            victim = 0;
+            for (uint32_t i = 1; i < ways; i++) {
+                // Wrap around safe
+                if ((int32_t)(stamps[i] - stamps[victim]) < 0)
+                    victim = i;
+            }
+        }
+    }
+    tags[victim] = line;
+    stamps[victim] = cache->clock;
+    cache->stats.misses++;
+    cache->stats.miss_bytes += ctx->tex_cache_config.line_size;
+}
+
+// Sum up the caches of all workers, called at the end of a frame
+void s3d_tex_cache_end_frame(S3D_CONTEXT *ctx) {
+    S3D_TEX_CACHE_STATS *stats = &ctx->last_tex_cache_stats;
+    memset(stats, 0, sizeof(S3D_TEX_CACHE_STATS));
+    if (ctx->tex_cache) {
+        for (uint32_t i = 0; i < MAX_WORKERS; i++) {
+            for (uint32_t t = 0; t < TMU_COUNT; t++) {
+                S3D_TEX_CACHE_TMU_STATS *cache_stats =
+                        &ctx->tex_cache[i * TMU_COUNT + t].stats;
+                S3D_TEX_CACHE_TMU_STATS *tmu_stats = &stats->tmu[t];
+                tmu_stats->accesses += cache_stats->accesses;
+                tmu_stats->hits += cache_stats->hits;
+                tmu_stats->misses += cache_stats->misses;
+                tmu_stats->miss_bytes += cache_stats->miss_bytes;
+                memset(cache_stats, 0, sizeof(S3D_TEX_CACHE_TMU_STATS));
+            }
+        }
+        for (uint32_t t = 0; t < TMU_COUNT; t++) {
+            stats->accesses += stats->tmu[t].accesses;
+            stats->hits += stats->tmu[t].hits;
+            stats->misses += stats->tmu[t].misses;
+            stats->miss_bytes += stats->tmu[t].miss_bytes;
+        }
+        if (stats->accesses)
+            stats->hit_rate = (float)stats->hits / (float)stats->accesses;
+    }
+}
+
+void s3d_get_tex_cache_stats(S3D_CONTEXT *ctx, S3D_TEX_CACHE_STATS *stats) {
+    *stats = ctx->last_tex_cache_stats;
+}
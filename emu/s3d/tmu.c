@@ -34,83 +34,296 @@
 // G1 G1 B1 B1
 // G1 G1 B1 B1
 
-static VEC3 s3d_tex_lookup_single(uint32_t tmu_id, int level, int x, int y) {
-    VEC3 result = {0.0f, 0.0f, 0.0f};
-    TMU *tmu = &s3d_context.tmu[tmu_id];
-    size_t offset = 1u << level;
-    if (x < 0) x = 0;
-    if (x >= tmu->width) x = tmu->width - 1;
-    if (y < 0) x = 0;
-    if (y >= tmu->height) x = tmu->height - 1;
-    uint8_t r = s3d_context.vram[tmu->address + (y * tmu->width * 2 + offset + x)];
-    uint8_t g = s3d_context.vram[tmu->address + ((offset + y) * tmu->width * 2 + x)];
-    uint8_t b = s3d_context.vram[tmu->address + ((offset + y) * tmu->width * 2 + offset + x)];
-    result.x = (float)r / 255.0f;
-    result.y = (float)g / 255.0f;
-    result.z = (float)b / 255.0f;
-    return result;
+// Lookups may run on several tile workers at once
+static void atomic_min(int32_t *target, int32_t val) {
+    int cur = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while ((val < cur) && !__atomic_compare_exchange_n(target, &cur, val,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-extern int min_level, max_level;
+static void atomic_max(int32_t *target, int32_t val) {
+    int cur = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while ((val > cur) && !__atomic_compare_exchange_n(target, &cur, val,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-// The following are parts of the GPU
-VEC4 s3d_tex_lookup(uint32_t tmu_id, float dmax, VEC2 tex_coord) {
-    TMU *tmu = &s3d_context.tmu[tmu_id];
-    VEC4 result = {0.0f, 0.0f, 0.0f, 0.0f};
-    if (!tmu->enabled)
-        return result;
-#if 1
-    // Determine mipmap levels
-    dmax = dmax * tmu->width;
-    dmax = logf(dmax) / logf(2.0);
-    dmax = ceil(dmax);
-    int level = (int)dmax;
-    if (level < 0) level = 0;
-
-    if (level > tmu->mipmap_levels)
-        level = tmu->mipmap_levels;
+// Every lane of the vectors below is one pixel of a quad
+typedef int32_t QUAD_INT __attribute__((vector_size(FS_LANE_COUNT * sizeof(int32_t))));
+
+// Same as s3d_part1by1, for all lanes
+static inline QUAD_INT s3d_part1by1_quad(QUAD_INT x) {
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// Same as fmodf(fabsf(a), 1.0f)
+static inline FS_LANES s3d_wrap_quad(FS_LANES a) {
+    a = (FS_LANES)((QUAD_INT)a & 0x7fffffff);
+    // Anything from 2^23 up is integral already, and may not fit into int32
+    QUAD_INT integral = a >= 8388608.0f;
+    a = (FS_LANES)((QUAD_INT)a & ~integral);
+    return a - __builtin_convertvector(
+            __builtin_convertvector(a, QUAD_INT), FS_LANES);
+}
+
+static inline FS_LANES s3d_lerp_quad(FS_LANES factor, FS_LANES r1,
+        FS_LANES r2) {
+    return r1 * factor + r2 * (1.f - factor);
+}
+
+// Load one byte per lane. Only lanes set in masks are loaded, coordinates of
+// inactive lanes may be garbage (NaN) and their address out of VRAM.
+static inline FS_LANES s3d_tex_gather(S3D_CONTEXT *ctx, S3D_TEX_CACHE *cache,
+        const bool *masks, QUAD_INT address) {
+    FS_LANES result = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < FS_LANE_COUNT; i++) {
+        if (!masks[i])
+            continue;
+        if (cache)
+            s3d_tex_cache_access(ctx, cache, address[i]);
+        result[i] = (float)ctx->vram[address[i]];
+    }
+    return result / 255.0f;
+}
+
+// Fetch r, g, b, a of texel x, y of every lane, x and y are within the level
+static void s3d_tex_fetch_quad(S3D_CONTEXT *ctx, S3D_TEX_CACHE *cache,
+        S3D_BC_CACHE *bc_cache, TMU *tmu, const bool *masks,
+        uint32_t level_factor, QUAD_INT x, QUAD_INT y, FS_LANES *rgb) {
+    if (tmu->format != TEX_FORMAT_RGB8) {
+        // Inactive lanes are discarded, so they are not decoded
+        for (int i = 0; i < FS_LANE_COUNT; i++) {
+            uint8_t texel[4] = {0, 0, 0, 0};
+            if (masks[i])
+                s3d_bc_fetch(ctx, cache, bc_cache, tmu, level_factor, x[i],
+                        y[i], texel);
+            for (int c = 0; c < 4; c++)
+                rgb[c][i] = (float)texel[c];
+        }
+        for (int c = 0; c < 4; c++)
+            rgb[c] /= 255.0f;
+    }
+    else if (tmu->layout == TEX_LAYOUT_MORTON) {
+        QUAD_INT address = (s3d_part1by1_quad(x) |
+                (s3d_part1by1_quad(y) << 1)) * 4;
+        address += tmu->address +
+                s3d_morton_level_offset(tmu->mipmap_levels, level_factor);
+        // One access per texel, all channels are on the same line
+        rgb[0] = s3d_tex_gather(ctx, cache, masks, address);
+        rgb[1] = s3d_tex_gather(ctx, NULL, masks, address + 1);
+        rgb[2] = s3d_tex_gather(ctx, NULL, masks, address + 2);
+        rgb[3] = s3d_tex_gather(ctx, NULL, masks, address + 3);
+    }
+    else {
+        int32_t offset = 1 << level_factor;
+        int32_t stride = tmu->width * 2;
+        QUAD_INT r = tmu->address + y * stride + offset + x;
+        QUAD_INT g = tmu->address + (offset + y) * stride + x;
+        rgb[0] = s3d_tex_gather(ctx, cache, masks, r);
+        rgb[1] = s3d_tex_gather(ctx, cache, masks, g);
+        rgb[2] = s3d_tex_gather(ctx, cache, masks, g + offset);
+        // No alpha plane
+        rgb[3] = (FS_LANES){1.0f, 1.0f, 1.0f, 1.0f};
+    }
+}
+
+// Footprint of a lookup, all lanes of a quad share it
+typedef struct {
+    float lod; // log2 of the footprint in level 0 texels, bias included
+    int taps; // Anisotropic taps, 1 otherwise
+    float du; // Step between taps, in texture coordinates
+    float dv;
+} TEX_FOOTPRINT;
+
+// LOD from the Jacobian of the texture coordinates. Anisotropic filtering
+// takes up to max_anisotropy taps along the major axis, each with the LOD of
+// the minor axis.
+static void s3d_tex_footprint(TMU *tmu, float dudx, float dvdx, float dudy,
+        float dvdy, TEX_FOOTPRINT *footprint) {
+    float rho_x = sqrtf(dudx * tmu->width * dudx * tmu->width +
+            dvdx * tmu->height * dvdx * tmu->height);
+    float rho_y = sqrtf(dudy * tmu->width * dudy * tmu->width +
+            dvdy * tmu->height * dvdy * tmu->height);
+    float rho_max = rho_x;
+    float rho_min = rho_y;
+    float axis_u = dudx;
+    float axis_v = dvdx;
+    if (rho_y > rho_x) {
+        rho_max = rho_y;
+        rho_min = rho_x;
+        axis_u = dudy;
+        axis_v = dvdy;
+    }
+
+    footprint->taps = 1;
+    footprint->du = 0.0f;
+    footprint->dv = 0.0f;
+    if (tmu->sampler.filter == TEX_FILTER_ANISOTROPIC) {
+        uint32_t taps = tmu->sampler.max_anisotropy;
+        if (rho_min * taps > rho_max)
+            taps = (uint32_t)ceilf(rho_max / rho_min);
+        if (taps > 1) {
+            footprint->taps = taps;
+            footprint->du = axis_u / taps;
+            footprint->dv = axis_v / taps;
+            rho_max /= taps;
+        }
+    }
+    footprint->lod = log2f(rho_max) + tmu->sampler.lod_bias;
+}
+
+// Sample all lanes from one level, as number of halvings from the full size
+static void s3d_tex_sample_level(S3D_CONTEXT *ctx, S3D_TEX_CACHE *cache,
+        S3D_BC_CACHE *bc_cache, TMU *tmu, const bool *masks, uint32_t active,
+        int level, bool nearest, FS_LANES u, FS_LANES v, FS_LANES *rgb) {
     uint32_t level_factor = tmu->mipmap_levels - level;
+    int32_t width = tmu->width >> level;
+    int32_t height = tmu->height >> level;
 
-    if (min_level > (int)level_factor)
-        min_level = level_factor;
-    if (max_level < (int)level_factor)
-        max_level = level_factor;
+    if (ctx->stats_enabled) {
+        atomic_min(&ctx->stats.min_mip_level, level_factor);
+        atomic_max(&ctx->stats.max_mip_level, level_factor);
+        S3D_STAT_ADD(ctx->stats.texels_fetched, active * (nearest ? 1 : 4));
+    }
 
     // TODO: Implement proper/ configurable clamping?
-    tex_coord.x = fmodf(fabsf(tex_coord.x), 1.0f);
-    tex_coord.y = fmodf(fabsf(tex_coord.y), 1.0f);
-    float texel_x = tex_coord.x * (tmu->width >> level);
-    float texel_y = tex_coord.y * (tmu->height >> level);
-    uint32_t x = (uint32_t)texel_x; // Truncate
-    uint32_t y = (uint32_t)texel_y;
-    texel_x = texel_x - (float)x;
-    texel_y = texel_y - (float)y;
-
-    VEC3 ul = s3d_tex_lookup_single(tmu_id, level_factor, x, y);
-    VEC3 ur = s3d_tex_lookup_single(tmu_id, level_factor, x + 1, y);
-    VEC3 ll = s3d_tex_lookup_single(tmu_id, level_factor, x, y + 1);
-    VEC3 lr = s3d_tex_lookup_single(tmu_id, level_factor, x + 1, y + 1);
-
-    VEC3 u = vec3_lerp(texel_x, ur, ul);
-    VEC3 l = vec3_lerp(texel_x, lr, ll);
-    VEC3 p = vec3_lerp(texel_y, l, u);
-
-    //VEC3 p = s3d_tex_lookup_single(tmu_id, level_factor, x, y);
-
-    result.x = p.x;
-    result.y = p.y;
-    result.z = p.z;
-
-    //printf("TEX %d, %d, %.2f, %.2f -> %.2f, %.2f, %.2f\n", tmu_id, level,
-    //        tex_coord.x, tex_coord.y, result.x, result.y, result.z);
-
-    // TODO: Implement alpha channel
+    FS_LANES texel_x = s3d_wrap_quad(u) * (float)width;
+    FS_LANES texel_y = s3d_wrap_quad(v) * (float)height;
+    QUAD_INT x0 = __builtin_convertvector(texel_x, QUAD_INT); // Truncate
+    QUAD_INT y0 = __builtin_convertvector(texel_y, QUAD_INT);
+    if (nearest) {
+        s3d_tex_fetch_quad(ctx, cache, bc_cache, tmu, masks, level_factor,
+                x0, y0, rgb);
+        return;
+    }
+    texel_x -= __builtin_convertvector(x0, FS_LANES);
+    texel_y -= __builtin_convertvector(y0, FS_LANES);
+    // Clamp to the edge of the level, comparisons are -1 when true
+    QUAD_INT x1 = x0 - ((x0 + 1) < width);
+    QUAD_INT y1 = y0 - ((y0 + 1) < height);
+
+    FS_LANES ul[4], ur[4], ll[4], lr[4];
+    s3d_tex_fetch_quad(ctx, cache, bc_cache, tmu, masks, level_factor,
+            x0, y0, ul);
+    s3d_tex_fetch_quad(ctx, cache, bc_cache, tmu, masks, level_factor,
+            x1, y0, ur);
+    s3d_tex_fetch_quad(ctx, cache, bc_cache, tmu, masks, level_factor,
+            x0, y1, ll);
+    s3d_tex_fetch_quad(ctx, cache, bc_cache, tmu, masks, level_factor,
+            x1, y1, lr);
+
+    for (int i = 0; i < 4; i++) {
+        FS_LANES upper = s3d_lerp_quad(texel_x, ur[i], ul[i]);
+        FS_LANES lower = s3d_lerp_quad(texel_x, lr[i], ll[i]);
+        rgb[i] = s3d_lerp_quad(texel_y, lower, upper);
+    }
+}
+
+// The following are parts of the GPU
+static void s3d_tex_filter(S3D_CONTEXT *ctx, uint32_t tmu_id,
+        const bool *masks, FS_LANES u, FS_LANES v, TEX_FOOTPRINT *footprint,
+        FS_LANES *result) {
+    TMU *tmu = &ctx->tmu[tmu_id];
+    for (int i = 0; i < 4; i++)
+        result[i] = (FS_LANES){0.0f, 0.0f, 0.0f, 0.0f};
+    if (!tmu->enabled)
+        return;
+
+    uint32_t active = 0;
+    for (int i = 0; i < FS_LANE_COUNT; i++)
+        active += masks[i];
+    if (ctx->stats_enabled)
+        S3D_STAT_ADD(ctx->stats.texture_samples, active);
+
+    // Negated to catch NaN from zero derivatives
+    float lod = footprint->lod;
+    if (!(lod > 0.0f))
+        lod = 0.0f;
+    if (lod > tmu->mipmap_levels)
+        lod = tmu->mipmap_levels;
+    TEX_FILTER filter = tmu->sampler.filter;
+    bool nearest = (filter == TEX_FILTER_NEAREST);
+    int level;
+    float blend = 0.0f;
+    if ((filter == TEX_FILTER_NEAREST) || (filter == TEX_FILTER_BILINEAR)) {
+        level = (int)(lod + 0.5f);
+    }
+    else {
+        level = (int)lod;
+        blend = lod - (float)level;
+    }
+
+    S3D_TEX_CACHE *cache = s3d_tex_cache_get(ctx, tmu_id);
+    S3D_BC_CACHE *bc_cache = s3d_bc_cache_get(ctx, tmu_id);
+    for (int tap = 0; tap < footprint->taps; tap++) {
+        float offset = (float)tap - (float)(footprint->taps - 1) * 0.5f;
+        FS_LANES tap_u = u + footprint->du * offset;
+        FS_LANES tap_v = v + footprint->dv * offset;
+        FS_LANES rgb[4];
+        s3d_tex_sample_level(ctx, cache, bc_cache, tmu, masks, active, level,
+                nearest, tap_u, tap_v, rgb);
+        if (blend > 0.0f) {
+            FS_LANES next[4];
+            s3d_tex_sample_level(ctx, cache, bc_cache, tmu, masks, active,
+                    level + 1, nearest, tap_u, tap_v, next);
+            FS_LANES factor = (FS_LANES){0.0f, 0.0f, 0.0f, 0.0f} + blend;
+            for (int i = 0; i < 4; i++)
+                rgb[i] = s3d_lerp_quad(factor, next[i], rgb[i]);
+        }
+        for (int i = 0; i < 4; i++)
+            result[i] += rgb[i];
+    }
+    if (footprint->taps > 1) {
+        for (int i = 0; i < 4; i++)
+            result[i] *= 1.0f / footprint->taps;
+    }
     // TODO: Implement reading from float buffer
-#else
-    result.x = tex_coord.x;
-    result.y = tex_coord.y;
-    result.z = 0;
-#endif
-    
-    return result;
+}
+
+static void s3d_tex_sample(S3D_CONTEXT *ctx, uint32_t tmu_id,
+        const bool *masks, FS_LANES u, FS_LANES v, TEX_FOOTPRINT *footprint,
+        FS_LANES *result) {
+    if (!ctx->stage_timing) {
+        s3d_tex_filter(ctx, tmu_id, masks, u, v, footprint, result);
+        return;
+    }
+    uint64_t start = s3d_timestamp();
+    s3d_tex_filter(ctx, tmu_id, masks, u, v, footprint, result);
+    S3D_STAT_ADD(ctx->stage_time.tmu, s3d_timestamp() - start);
+}
+
+// Single lookups run on lane 0 of the quad path
+VEC4 s3d_tex_lookup_grad(S3D_CONTEXT *ctx, uint32_t tmu_id, VEC2 tex_coord,
+        VEC2 ddx, VEC2 ddy) {
+    static const bool masks[4] = {true, false, false, false};
+    TEX_FOOTPRINT footprint;
+    s3d_tex_footprint(&ctx->tmu[tmu_id], ddx.x, ddx.y, ddy.x, ddy.y,
+            &footprint);
+    FS_LANES u = {tex_coord.x, tex_coord.x, tex_coord.x, tex_coord.x};
+    FS_LANES v = {tex_coord.y, tex_coord.y, tex_coord.y, tex_coord.y};
+    FS_LANES result[4];
+    s3d_tex_sample(ctx, tmu_id, masks, u, v, &footprint, result);
+    VEC4 color = {result[0][0], result[1][0], result[2][0], result[3][0]};
+    return color;
+}
+
+// dmax is taken as an isotropic footprint
+VEC4 s3d_tex_lookup(S3D_CONTEXT *ctx, uint32_t tmu_id, float dmax,
+        VEC2 tex_coord) {
+    VEC2 ddx = {dmax, 0.0f};
+    VEC2 ddy = {0.0f, dmax};
+    return s3d_tex_lookup_grad(ctx, tmu_id, tex_coord, ddx, ddy);
+}
+
+void s3d_tex_lookup_quad(S3D_CONTEXT *ctx, uint32_t tmu_id, const bool *masks,
+        FS_LANES u, FS_LANES v, FS_LANES *result) {
+    // Derivatives are shared by the whole quad
+    TEX_FOOTPRINT footprint;
+    s3d_tex_footprint(&ctx->tmu[tmu_id], u[1] - u[0], v[1] - v[0],
+            u[2] - u[0], v[2] - v[0], &footprint);
+    s3d_tex_sample(ctx, tmu_id, masks, u, v, &footprint, result);
 }
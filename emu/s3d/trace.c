@@ -0,0 +1,166 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Timeline tracing
+// Spans are recorded as Chrome trace "complete" events into a fixed size
+// buffer, which is written out to the JSON file whenever it fills up, so
+// memory use stays bounded no matter how long the trace runs. The trace is
+// process wide, covering every context and thread. Open the file with
+// chrome://tracing or ui.perfetto.dev.
+
+#define TRACE_BUFFER_SIZE (16384)
+
+typedef struct {
+    const char *name;
+    uint32_t tid;
+    char phase; // 'X' for spans, 'M' for thread names
+    uint64_t start;
+    uint64_t duration;
+} TRACE_EVENT;
+
+typedef struct {
+    pthread_mutex_t lock;
+    FILE *fp;
+    uint64_t start_time;
+    uint32_t session;
+    bool first_event;
+    size_t used;
+    TRACE_EVENT events[TRACE_BUFFER_SIZE];
+} TRACER;
+
+uint32_t s3d_trace_flags;
+
+static TRACER tracer = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static uint32_t next_tid = 1;
+
+static __thread uint32_t thread_tid;
+static __thread uint32_t thread_session; // Session thread name was sent in
+static __thread const char *thread_name;
+
+static uint32_t s3d_trace_tid(void) {
+    if (thread_tid == 0)
+        thread_tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    return thread_tid;
+}
+
+// Lock must be held
+static void s3d_trace_flush(void) {
+    for (size_t i = 0; i < tracer.used; i++) {
+        TRACE_EVENT *event = &tracer.events[i];
+        fprintf(tracer.fp, "%s\n", tracer.first_event ? "" : ",");
+        tracer.first_event = false;
+        if (event->phase == 'M') {
+            fprintf(tracer.fp, "{\"name\":\"thread_name\",\"ph\":\"M\","
+                    "\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    event->tid, event->name);
+        }
+        else {
+            fprintf(tracer.fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    event->name, event->tid,
+                    (event->start - tracer.start_time) / 1000.0,
+                    event->duration / 1000.0);
+        }
+    }
+    tracer.used = 0;
+}
+
+// Lock must be held
+static void s3d_trace_push(TRACE_EVENT *event) {
+    if (tracer.used == TRACE_BUFFER_SIZE)
+        s3d_trace_flush();
+    tracer.events[tracer.used++] = *event;
+}
+
+bool s3d_trace_start(const char *filename, uint32_t flags) {
+    pthread_mutex_lock(&tracer.lock);
+    assert(!tracer.fp);
+    tracer.fp = fopen(filename, "w");
+    if (!tracer.fp) {
+        pthread_mutex_unlock(&tracer.lock);
+        printf("Failed to open trace file %s\n", filename);
+        return false;
+    }
+    fprintf(tracer.fp, "{\"traceEvents\":[");
+    tracer.start_time = s3d_timestamp();
+    tracer.session++;
+    tracer.first_event = true;
+    tracer.used = 0;
+    __atomic_store_n(&s3d_trace_flags, flags | S3D_TRACE_ENABLED,
+            __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tracer.lock);
+    return true;
+}
+
+void s3d_trace_stop(void) {
+    pthread_mutex_lock(&tracer.lock);
+    __atomic_store_n(&s3d_trace_flags, 0, __ATOMIC_RELAXED);
+    if (tracer.fp) {
+        s3d_trace_flush();
+        fprintf(tracer.fp, "\n]}\n");
+        fclose(tracer.fp);
+        tracer.fp = NULL;
+    }
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+void s3d_trace_thread_name(const char *name) {
+    thread_name = name;
+    thread_session = 0;
+}
+
+uint64_t s3d_trace_begin(void) {
+    return s3d_trace_span_begin(S3D_TRACE_ENABLED);
+}
+
+void s3d_trace_end(const char *name, uint64_t start) {
+    if (start == 0)
+        return;
+    TRACE_EVENT event;
+    event.name = name;
+    event.tid = s3d_trace_tid();
+    event.phase = 'X';
+    event.start = start;
+    event.duration = s3d_timestamp() - start;
+
+    pthread_mutex_lock(&tracer.lock);
+    // Tracing may have been stopped since the span began
+    if (tracer.fp && (event.start >= tracer.start_time)) {
+        if (thread_name && (thread_session != tracer.session)) {
+            TRACE_EVENT meta = {thread_name, event.tid, 'M', 0, 0};
+            s3d_trace_push(&meta);
+            thread_session = tracer.session;
+        }
+        s3d_trace_push(&event);
+    }
+    pthread_mutex_unlock(&tracer.lock);
+}
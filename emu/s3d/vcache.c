@@ -0,0 +1,210 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// Post-transform vertex cache
+// Vertices are looked up by index before running the vertex shader. The FIFO
+// mode models a small hardware cache, the full mode keeps every transformed
+// vertex of the draw, so each vertex is only shaded once.
+// In full mode all unique indices of the draw are collected upfront, and
+// shaded in batches of VS_BATCH_SIZE vertices, with attributes transposed
+// into SoA layout. Large draws are split into chunks shaded by the workers.
+
+#define VS_CHUNK_SIZE (256) // Vertices per worker job, multiple of batch size
+
+static void s3d_run_vs(S3D_CONTEXT *ctx, VERTEX_CACHE_STATE *cache,
+        uint32_t index, POST_VS_VERTEX *vertex) {
+    ctx->active_program.vs(
+        ctx->uniforms,
+        &cache->attributes[cache->attribute_stride * index],
+        &vertex->varying[0],
+        &vertex->position
+    );
+    ctx->vertex_cache_stats.misses++;
+}
+
+// Shade one chunk of unique vertices
+static void s3d_run_vs_chunk(void *arg, uint32_t chunk) {
+    S3D_CONTEXT *ctx = arg;
+    VERTEX_CACHE_STATE *cache = &ctx->vertex_cache_state;
+    uint32_t stride = cache->attribute_stride;
+    uint32_t attribute_count = MIN(stride, MAX_VARYING);
+    uint32_t varying_count = ctx->varying_count;
+    uint32_t first = chunk * VS_CHUNK_SIZE;
+    uint32_t last = MIN(first + VS_CHUNK_SIZE, cache->unique_count);
+    S3D_VS_BATCH vs_batch = ctx->active_program.vs_batch;
+
+    // Programs without a batch VS are shaded one vertex at a time
+    if (!vs_batch) {
+        S3D_VS vs = ctx->active_program.vs;
+        for (uint32_t i = first; i < last; i++) {
+            uint32_t index = cache->unique[i];
+            POST_VS_VERTEX *vertex = &cache->vertices[index];
+            vs(ctx->uniforms, &cache->attributes[stride * index],
+                    &vertex->varying[0], &vertex->position);
+        }
+        return;
+    }
+
+    VS_LANES attributes[MAX_VARYING];
+    VS_LANES varying[MAX_VARYING - 4];
+    VS_LANES position[4];
+    memset(attributes, 0, sizeof(attributes));
+    memset(varying, 0, sizeof(varying));
+
+    for (uint32_t base = first; base < last; base += VS_BATCH_SIZE) {
+        uint32_t lanes = MIN(last - base, VS_BATCH_SIZE);
+        uint32_t *indices = &cache->unique[base];
+
+        // Transpose into SoA
+        for (uint32_t l = 0; l < lanes; l++) {
+            float *src = &cache->attributes[stride * indices[l]];
+            for (uint32_t a = 0; a < attribute_count; a++)
+                attributes[a][l] = src[a];
+        }
+
+        vs_batch(ctx->uniforms, attributes, varying, position);
+
+        // Transpose back into the vertex buffer
+        for (uint32_t l = 0; l < lanes; l++) {
+            POST_VS_VERTEX *vertex = &cache->vertices[indices[l]];
+            vertex->position.x = position[0][l];
+            vertex->position.y = position[1][l];
+            vertex->position.z = position[2][l];
+            vertex->position.w = position[3][l];
+            for (uint32_t v = 0; v < varying_count; v++)
+                vertex->varying[v] = varying[v][l];
+        }
+    }
+}
+
+// Prepare the cache for a new draw, indices from previous draws are not valid
+// anymore.
+void s3d_vertex_cache_begin(S3D_CONTEXT *ctx, float *attributes,
+        uint32_t attribute_stride, uint32_t vertex_count, uint32_t *indices,
+        uint32_t index_count) {
+    VERTEX_CACHE_STATE *cache = &ctx->vertex_cache_state;
+    cache->attributes = attributes;
+    cache->attribute_stride = attribute_stride;
+    cache->vertex_count = vertex_count;
+
+    switch (ctx->vertex_cache) {
+    case VERTEX_CACHE_NONE:
+        break;
+    case VERTEX_CACHE_FIFO:
+        for (uint32_t i = 0; i < MAX_VERTEX_CACHE_SIZE; i++)
+            cache->fifo_tags[i] = UINT32_MAX;
+        cache->fifo_head = 0;
+        break;
+    case VERTEX_CACHE_FULL:
+        if (vertex_count > cache->capacity) {
+            free(cache->vertices);
+            free(cache->stamps);
+            free(cache->unique);
+            cache->vertices = malloc(vertex_count * sizeof(POST_VS_VERTEX));
+            cache->stamps = calloc(vertex_count, sizeof(uint32_t));
+            cache->unique = malloc(vertex_count * sizeof(uint32_t));
+            assert(cache->vertices);
+            assert(cache->stamps);
+            assert(cache->unique);
+            cache->capacity = vertex_count;
+            cache->generation = 0;
+        }
+        // Entries are valid if stamped with the current generation, so the
+        // buffer doesn't need to be cleared for every draw
+        cache->generation++;
+        if (cache->generation == 0) {
+            memset(cache->stamps, 0, cache->capacity * sizeof(uint32_t));
+            cache->generation = 1;
+        }
+
+        // Collect unique indices
+        cache->unique_count = 0;
+        for (uint32_t i = 0; i < index_count; i++) {
+            uint32_t index = indices[i];
+            assert(index < vertex_count);
+            if (cache->stamps[index] == cache->generation)
+                continue;
+            cache->stamps[index] = cache->generation;
+            cache->unique[cache->unique_count++] = index;
+        }
+        ctx->vertex_cache_stats.misses += cache->unique_count;
+        ctx->vertex_cache_stats.hits += index_count - cache->unique_count;
+
+        s3d_pool_run(ctx, s3d_run_vs_chunk, ctx,
+                (cache->unique_count + VS_CHUNK_SIZE - 1) / VS_CHUNK_SIZE);
+        break;
+    }
+}
+
+// Get transformed vertex. In full mode this points into the vertex buffer,
+// otherwise the result is copied into the scratch vertex, as FIFO entries
+// could be replaced by the next fetch.
+POST_VS_VERTEX *s3d_vertex_cache_fetch(S3D_CONTEXT *ctx, uint32_t index,
+        POST_VS_VERTEX *vertex) {
+    VERTEX_CACHE_STATE *cache = &ctx->vertex_cache_state;
+    assert(index < cache->vertex_count);
+
+    switch (ctx->vertex_cache) {
+    case VERTEX_CACHE_NONE:
+        s3d_run_vs(ctx, cache, index, vertex);
+        break;
+    case VERTEX_CACHE_FIFO:
+        for (uint32_t i = 0; i < ctx->vertex_cache_size; i++) {
+            if (cache->fifo_tags[i] == index) {
+                *vertex = cache->fifo[i];
+                ctx->vertex_cache_stats.hits++;
+                return vertex;
+            }
+        }
+        s3d_run_vs(ctx, cache, index, vertex);
+        cache->fifo_tags[cache->fifo_head] = index;
+        cache->fifo[cache->fifo_head] = *vertex;
+        cache->fifo_head++;
+        if (cache->fifo_head == ctx->vertex_cache_size)
+            cache->fifo_head = 0;
+        break;
+    case VERTEX_CACHE_FULL:
+        // Already shaded in s3d_vertex_cache_begin
+        return &cache->vertices[index];
+    }
+    return vertex;
+}
+
+void s3d_vertex_cache_deinit(S3D_CONTEXT *ctx) {
+    VERTEX_CACHE_STATE *cache = &ctx->vertex_cache_state;
+    free(cache->vertices);
+    free(cache->stamps);
+    free(cache->unique);
+    cache->vertices = NULL;
+    cache->stamps = NULL;
+    cache->unique = NULL;
+    cache->capacity = 0;
+}
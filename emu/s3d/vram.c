@@ -0,0 +1,259 @@
+//
+// Servaru
+// Copyright 2022 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vecmath.h"
+#include "s3d.h"
+#include "utils.h"
+#include "s3d_private.h"
+
+// VRAM backing memory
+// VRAM is mapped either anonymously, or from a backing file. Pages are only
+// committed by the OS once touched, so a large VRAM costs nothing until used.
+// Allocator and object tables are not in VRAM, a backing file is truncated
+// on map so a new context never sees stale contents as if they were valid.
+
+static void s3d_vram_map(S3D_CONTEXT *ctx, S3D_VRAM_CONFIG *config) {
+    size_t size = config->size ? config->size : VRAM_SIZE;
+    // Round up to page size
+    long page_size = sysconf(_SC_PAGESIZE);
+    size = (size + page_size - 1) / page_size * page_size;
+    assert(size <= MAX_VRAM_SIZE);
+
+    void *vram;
+    if (config->backing_file) {
+        int fd = open(config->backing_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        int result = ftruncate(fd, size);
+        assert(result == 0);
+        vram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ctx->vram_fd = fd;
+    }
+    else {
+        vram = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ctx->vram_fd = -1;
+    }
+    assert(vram != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+    if (config->huge_pages && (madvise(vram, size, MADV_HUGEPAGE) != 0))
+        printf("Huge pages not available for VRAM\n");
+#endif
+    ctx->vram = vram;
+    ctx->vram_size = size;
+}
+
+static void s3d_vram_unmap(S3D_CONTEXT *ctx) {
+    munmap(ctx->vram, ctx->vram_size);
+    if (ctx->vram_fd >= 0)
+        close(ctx->vram_fd);
+    ctx->vram = NULL;
+    ctx->vram_size = 0;
+}
+
+void s3d_sync_vram(S3D_CONTEXT *ctx) {
+    if (ctx->vram_fd >= 0)
+        msync(ctx->vram, ctx->vram_size, MS_SYNC);
+}
+
+// VRAM allocator
+// Binary buddy allocator. VRAM is managed in blocks of VRAM_MIN_BLOCK << order
+// bytes, every block is aligned to its own size. Freed blocks are merged with
+// their buddy whenever the buddy is free as well. Bookkeeping is kept outside
+// of VRAM: one bitmap of free blocks per order, and the order of every
+// allocation indexed by its first minimum block.
+
+#define VRAM_MIN_BLOCK_SHIFT (8)
+#define VRAM_MIN_BLOCK (1u << VRAM_MIN_BLOCK_SHIFT)
+#define VRAM_MAX_ORDERS (32 - VRAM_MIN_BLOCK_SHIFT)
+#define VRAM_NOT_ALLOCATED (0xff)
+
+struct S3D_VRAM_ALLOCATOR {
+    uint32_t size;
+    uint32_t blocks; // Number of minimum blocks
+    uint32_t orders;
+    uint64_t *free_bits[VRAM_MAX_ORDERS];
+    uint32_t free_count[VRAM_MAX_ORDERS];
+    uint32_t search_hint[VRAM_MAX_ORDERS]; // Word to start searching from
+    uint8_t *alloc_order;
+    uint32_t used;
+    uint32_t allocations;
+};
+
+static uint32_t s3d_vram_words(S3D_VRAM_ALLOCATOR *vram, uint32_t order) {
+    uint32_t entries = (vram->blocks + (1u << order) - 1) >> order;
+    return (entries + 63) / 64;
+}
+
+static bool s3d_vram_is_free(S3D_VRAM_ALLOCATOR *vram, uint32_t block,
+        uint32_t order) {
+    uint32_t bit = block >> order;
+    return (vram->free_bits[order][bit / 64] >> (bit % 64)) & 1;
+}
+
+static void s3d_vram_set_free(S3D_VRAM_ALLOCATOR *vram, uint32_t block,
+        uint32_t order) {
+    uint32_t bit = block >> order;
+    vram->free_bits[order][bit / 64] |= 1ull << (bit % 64);
+    vram->free_count[order]++;
+}
+
+static void s3d_vram_clear_free(S3D_VRAM_ALLOCATOR *vram, uint32_t block,
+        uint32_t order) {
+    uint32_t bit = block >> order;
+    vram->free_bits[order][bit / 64] &= ~(1ull << (bit % 64));
+    vram->free_count[order]--;
+}
+
+// Take any free block of given order, the order must have one
+static uint32_t s3d_vram_take(S3D_VRAM_ALLOCATOR *vram, uint32_t order) {
+    uint32_t words = s3d_vram_words(vram, order);
+    uint32_t word = vram->search_hint[order];
+    while (vram->free_bits[order][word] == 0) {
+        word++;
+        if (word == words)
+            word = 0;
+    }
+    vram->search_hint[order] = word;
+    uint32_t bit = word * 64 + __builtin_ctzll(vram->free_bits[order][word]);
+    uint32_t block = bit << order;
+    s3d_vram_clear_free(vram, block, order);
+    return block;
+}
+
+void s3d_vram_init(S3D_CONTEXT *ctx, S3D_VRAM_CONFIG *config) {
+    S3D_VRAM_CONFIG default_config = {0};
+    if (!config)
+        config = &default_config;
+    s3d_vram_map(ctx, config);
+    uint32_t size = ctx->vram_size;
+    assert((size % VRAM_MIN_BLOCK) == 0);
+    S3D_VRAM_ALLOCATOR *vram = calloc(1, sizeof(S3D_VRAM_ALLOCATOR));
+    assert(vram);
+    vram->size = size;
+    vram->blocks = size >> VRAM_MIN_BLOCK_SHIFT;
+    vram->orders = 32 - __builtin_clz(vram->blocks);
+    for (uint32_t i = 0; i < vram->orders; i++) {
+        vram->free_bits[i] = calloc(s3d_vram_words(vram, i), sizeof(uint64_t));
+        assert(vram->free_bits[i]);
+    }
+    vram->alloc_order = malloc(vram->blocks);
+    assert(vram->alloc_order);
+    memset(vram->alloc_order, VRAM_NOT_ALLOCATED, vram->blocks);
+
+    // Cover the whole region with the largest aligned blocks that fit
+    uint32_t block = 0;
+    while (block < vram->blocks) {
+        uint32_t order = vram->orders - 1;
+        while (((block & ((1u << order) - 1)) != 0) ||
+                (block + (1u << order) > vram->blocks))
+            order--;
+        s3d_vram_set_free(vram, block, order);
+        block += 1u << order;
+    }
+    ctx->vram_allocator = vram;
+}
+
+void s3d_vram_deinit(S3D_CONTEXT *ctx) {
+    S3D_VRAM_ALLOCATOR *vram = ctx->vram_allocator;
+    for (uint32_t i = 0; i < vram->orders; i++)
+        free(vram->free_bits[i]);
+    free(vram->alloc_order);
+    free(vram);
+    ctx->vram_allocator = NULL;
+    s3d_vram_unmap(ctx);
+}
+
+// Allocate from VRAM, alignment must be a power of 2. Returns VRAM address.
+uint32_t s3d_malloc(S3D_CONTEXT *ctx, uint32_t size, uint32_t alignment) {
+    S3D_VRAM_ALLOCATOR *vram = ctx->vram_allocator;
+    assert((alignment & (alignment - 1)) == 0);
+
+    // Blocks are aligned to their size
+    if (size < alignment) size = alignment;
+    uint32_t order = 0;
+    while (((uint64_t)VRAM_MIN_BLOCK << order) < size)
+        order++;
+
+    uint32_t available = order;
+    while ((available < vram->orders) && (vram->free_count[available] == 0))
+        available++;
+    if (available >= vram->orders) {
+        fprintf(stderr, "Out of VRAM allocating %d bytes\n", size);
+        assert(0);
+    }
+
+    // Split until the block is of the right size, upper halves are freed
+    uint32_t block = s3d_vram_take(vram, available);
+    while (available > order) {
+        available--;
+        s3d_vram_set_free(vram, block + (1u << available), available);
+    }
+
+    vram->alloc_order[block] = order;
+    vram->used += VRAM_MIN_BLOCK << order;
+    vram->allocations++;
+    return block << VRAM_MIN_BLOCK_SHIFT;
+}
+
+void s3d_free(S3D_CONTEXT *ctx, uint32_t address) {
+    S3D_VRAM_ALLOCATOR *vram = ctx->vram_allocator;
+    assert((address % VRAM_MIN_BLOCK) == 0);
+    uint32_t block = address >> VRAM_MIN_BLOCK_SHIFT;
+    assert(block < vram->blocks);
+    uint32_t order = vram->alloc_order[block];
+    assert(order != VRAM_NOT_ALLOCATED); // Double free?
+    vram->alloc_order[block] = VRAM_NOT_ALLOCATED;
+    vram->used -= VRAM_MIN_BLOCK << order;
+    vram->allocations--;
+
+    // Merge with free buddies
+    while (order + 1 < vram->orders) {
+        uint32_t buddy = block ^ (1u << order);
+        if ((buddy >= vram->blocks) || !s3d_vram_is_free(vram, buddy, order))
+            break;
+        s3d_vram_clear_free(vram, buddy, order);
+        block &= ~(1u << order);
+        order++;
+    }
+    s3d_vram_set_free(vram, block, order);
+}
+
+void s3d_get_vram_stats(S3D_CONTEXT *ctx, S3D_VRAM_STATS *stats) {
+    S3D_VRAM_ALLOCATOR *vram = ctx->vram_allocator;
+    stats->used = vram->used;
+    stats->free = vram->size - vram->used;
+    stats->largest_free_block = 0;
+    for (uint32_t i = vram->orders; i > 0; i--) {
+        if (vram->free_count[i - 1] != 0) {
+            stats->largest_free_block = VRAM_MIN_BLOCK << (i - 1);
+            break;
+        }
+    }
+    stats->allocations = vram->allocations;
+}
@@ -23,41 +23,95 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include "engine.h"
 
-void shader_init(SHADER *shader, const char *vs_path, const char *fs_path) {
-    
+// Shader programs
+// Uniform names are resolved against a table built from the declared layout
+// when the shader is created. Setting a uniform records an update of just
+// that range of the context uniform buffer.
+
+static const size_t uniform_size[] = {
+    [UNIFORM_INT] = sizeof(int),
+    [UNIFORM_FLOAT] = sizeof(float),
+    [UNIFORM_VEC3] = sizeof(VEC3),
+    [UNIFORM_VEC4] = sizeof(VEC4),
+    [UNIFORM_MAT3] = sizeof(MAT3),
+    [UNIFORM_MAT4] = sizeof(MAT4)
+};
+
+// FNV-1a, so most lookups only compare a single word
+static uint32_t shader_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-void shader_deinit(SHADER *shader) {
+void shader_init(S3D_CONTEXT *ctx, SHADER *shader, const SHADER_SOURCE *source) {
+    assert(source->num_uniforms <= MAX_SHADER_UNIFORMS);
+    shader->id = s3d_create_program(ctx, &source->program);
+    shader->cmdbuf = NULL;
+    shader->num_uniforms = source->num_uniforms;
+    for (size_t i = 0; i < source->num_uniforms; i++) {
+        const UNIFORM_DECL *decl = &source->uniforms[i];
+        UNIFORM_SLOT *slot = &shader->uniforms[i];
+        slot->hash = shader_hash(decl->name);
+        slot->name = decl->name;
+        slot->type = decl->type;
+        slot->offset = decl->offset;
+    }
+}
 
+void shader_deinit(S3D_CONTEXT *ctx, SHADER *shader) {
+    s3d_delete_program(ctx, shader->id);
+    shader->num_uniforms = 0;
 }
 
-void shader_use(SHADER *shader) {
+void shader_use(SHADER *shader, S3D_CMDBUF *cmdbuf) {
+    shader->cmdbuf = cmdbuf;
+    s3d_cmd_use_program(cmdbuf, shader->id);
+}
 
+static void shader_set(SHADER *shader, const char *name, UNIFORM_TYPE type,
+        const void *val) {
+    assert(shader->cmdbuf);
+    uint32_t hash = shader_hash(name);
+    for (size_t i = 0; i < shader->num_uniforms; i++) {
+        UNIFORM_SLOT *slot = &shader->uniforms[i];
+        if ((slot->hash != hash) || (strcmp(slot->name, name) != 0))
+            continue;
+        assert(slot->type == type);
+        s3d_cmd_update_uniform_range(shader->cmdbuf, slot->offset,
+                (void *)val, uniform_size[type]);
+        return;
+    }
+    // Like GL, setting a uniform the shader doesn't have is not an error
 }
 
 void shader_set_int(SHADER *shader, const char *name, const int val) {
-
+    shader_set(shader, name, UNIFORM_INT, &val);
 }
 
 void shader_set_float(SHADER *shader, const char *name, const float val) {
-
+    shader_set(shader, name, UNIFORM_FLOAT, &val);
 }
 
 void shader_set_vec3(SHADER *shader, const char *name, const VEC3 *val) {
-
+    shader_set(shader, name, UNIFORM_VEC3, val);
 }
 
 void shader_set_vec4(SHADER *shader, const char *name, const VEC4 *val) {
-
+    shader_set(shader, name, UNIFORM_VEC4, val);
 }
 
 void shader_set_mat3(SHADER *shader, const char *name, const MAT3 *val) {
-
+    shader_set(shader, name, UNIFORM_MAT3, val);
 }
 
 void shader_set_mat4(SHADER *shader, const char *name, const MAT4 *val) {
-
+    shader_set(shader, name, UNIFORM_MAT4, val);
 }
@@ -22,13 +22,49 @@
 //
 #pragma once
 
+#define MAX_SHADER_UNIFORMS (16)
+
+typedef enum {
+    UNIFORM_INT,
+    UNIFORM_FLOAT,
+    UNIFORM_VEC3,
+    UNIFORM_VEC4,
+    UNIFORM_MAT3,
+    UNIFORM_MAT4
+} UNIFORM_TYPE;
+
+// Uniform as laid out in the uniform struct of a shader, use offsetof
+typedef struct {
+    const char *name;
+    UNIFORM_TYPE type;
+    uint32_t offset;
+} UNIFORM_DECL;
+
+// Built-in shader program with its declared uniforms
+typedef struct {
+    S3D_PROGRAM program;
+    const UNIFORM_DECL *uniforms;
+    size_t num_uniforms;
+} SHADER_SOURCE;
+
+typedef struct {
+    uint32_t hash;
+    const char *name;
+    UNIFORM_TYPE type;
+    uint32_t offset;
+} UNIFORM_SLOT;
+
 typedef struct {
     uint32_t id;
+    // Command buffer passed to shader_use, uniform updates are recorded here
+    S3D_CMDBUF *cmdbuf;
+    UNIFORM_SLOT uniforms[MAX_SHADER_UNIFORMS];
+    size_t num_uniforms;
 } SHADER;
 
-void shader_init(SHADER *shader, const char *vs_path, const char *fs_path);
-void shader_deinit(SHADER *shader);
-void shader_use(SHADER *shader);
+void shader_init(S3D_CONTEXT *ctx, SHADER *shader, const SHADER_SOURCE *source);
+void shader_deinit(S3D_CONTEXT *ctx, SHADER *shader);
+void shader_use(SHADER *shader, S3D_CMDBUF *cmdbuf);
 void shader_set_int(SHADER *shader, const char *name, const int val);
 void shader_set_float(SHADER *shader, const char *name, const float val);
 void shader_set_vec3(SHADER *shader, const char *name, const VEC3 *val);
@@ -1,13 +1,15 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include "engine.h"
 #include "simple_shaders.h"
 
 //#define DEBUG
 
 // TODO: move gl_Position out of varying
-void simple_vs(UNIFORM *uniforms, float *attributes, float *varying, VEC4 *position) {
+void simple_vs(void *uniform_buffer, float *attributes, float *varying, VEC4 *position) {
+    UNIFORM *uniforms = uniform_buffer;
     // Input layout:
     VEC3 *a_position = (VEC3 *)&attributes[0];
     VEC2 *a_tex_coords = (VEC2 *)&attributes[3];
@@ -27,22 +29,81 @@ void simple_vs(UNIFORM *uniforms, float *attributes, float *varying, VEC4 *posit
 #endif
 }
 
-void simple_fs(UNIFORM *uniforms, float *varying, float *ddx, float *ddy, VEC3 *frag_color, float *frag_depth) {
+// Same as simple_vs, with the same order of operations as
+// mat4_multiply_by_vec4, so results are bit-identical to the scalar version.
+void simple_vs_batch(void *uniform_buffer, VS_LANES *attributes, VS_LANES *varying, VS_LANES *position) {
+    UNIFORM *uniforms = uniform_buffer;
+    // Input layout:
+    VS_LANES *a_position = &attributes[0];
+    VS_LANES *a_tex_coords = &attributes[3];
+    // Output layout
+    VS_LANES *tex_coords = &varying[0];
+
+    MAT4 *m = &uniforms->projection_view_matrix;
+    for (int i = 0; i < 4; i++) {
+        VS_LANES result = {0};
+        for (int j = 0; j < 3; j++) {
+            result += m->val[j][i] * a_position[j];
+        }
+        result += m->val[3][i];
+        position[i] = result;
+    }
+    tex_coords[0] = a_tex_coords[0];
+    tex_coords[1] = a_tex_coords[1];
+}
+
+void simple_fs(S3D_CONTEXT *ctx, void *uniform_buffer, float *varying, float *ddx, float *ddy, VEC3 *frag_color, float *frag_depth) {
     // Input layout:
     VEC2 *tex_coords = (VEC2 *)&varying[0];
 
-    float dxdx = ddx[0];
-    float dxdy = ddy[0];
-    float dydx = ddx[1];
-    float dydy = ddx[1];
+    VEC2 tex_ddx = {ddx[0], ddx[1]};
+    VEC2 tex_ddy = {ddy[0], ddy[1]};
 
     //printf("COORD: %.2f, %.2f, PD: %.2f, %.2f, %.2f, %.2f\n", tex_coords->x, tex_coords->y,
-    //        dxdx, dxdy, dydx, dydy);
+    //        tex_ddx.x, tex_ddy.x, tex_ddx.y, tex_ddy.y);
 
-    float dmax = fmaxf(fmaxf(dxdx, dxdy), fmaxf(dydx, dydy));
-    
-    VEC4 tex_result = s3d_tex_lookup(0, dmax, *tex_coords);
+    VEC4 tex_result = s3d_tex_lookup_grad(ctx, 0, *tex_coords, tex_ddx, tex_ddy);
     frag_color->x = tex_result.x;
     frag_color->y = tex_result.y;
     frag_color->z = tex_result.z;
 }
+
+// Same as simple_fs for a whole quad, the LOD is shared by the quad
+void simple_fs_quad(S3D_CONTEXT *ctx, void *uniform_buffer, const bool *masks, FS_LANES *varying, FS_LANES *frag_color, FS_LANES *frag_depth) {
+    // Input layout:
+    FS_LANES *tex_coords = &varying[0];
+
+    FS_LANES tex_result[4];
+    s3d_tex_lookup_quad(ctx, 0, masks, tex_coords[0], tex_coords[1], tex_result);
+    frag_color[0] = tex_result[0];
+    frag_color[1] = tex_result[1];
+    frag_color[2] = tex_result[2];
+}
+
+static const UNIFORM_DECL simple_uniforms[] = {
+    {"projection_view_matrix", UNIFORM_MAT4,
+            offsetof(UNIFORM, projection_view_matrix)}
+};
+
+const SHADER_SOURCE simple_shader_source = {
+    .program = {
+        .vs = simple_vs,
+        .vs_batch = simple_vs_batch,
+        .fs = simple_fs,
+        .fs_quad = simple_fs_quad,
+        .varying_count = 2
+    },
+    .uniforms = simple_uniforms,
+    .num_uniforms = sizeof(simple_uniforms) / sizeof(UNIFORM_DECL)
+};
+
+const SHADER_SOURCE depth_shader_source = {
+    .program = {
+        .vs = simple_vs,
+        .vs_batch = simple_vs_batch,
+        .fs = NULL,
+        .varying_count = 0
+    },
+    .uniforms = simple_uniforms,
+    .num_uniforms = sizeof(simple_uniforms) / sizeof(UNIFORM_DECL)
+};
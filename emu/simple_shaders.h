@@ -1,8 +1,19 @@
 #pragma once
 
+#include "shader.h"
+
 typedef struct {
     MAT4 projection_view_matrix;
 } UNIFORM;
 
-void simple_vs(UNIFORM *uniforms, float *attributes, float *varying, VEC4 *position);
-void simple_fs(UNIFORM *uniforms, float *varying, float *ddx, float *ddy, VEC3 *frag_color, float *frag_depth);
+// Batched vertex shader works on VS_BATCH_SIZE vertices at a time, with each
+// attribute/ varying/ position component stored as one vector of lanes (SoA).
+void simple_vs(void *uniform_buffer, float *attributes, float *varying, VEC4 *position);
+void simple_vs_batch(void *uniform_buffer, VS_LANES *attributes, VS_LANES *varying, VS_LANES *position);
+void simple_fs(S3D_CONTEXT *ctx, void *uniform_buffer, float *varying, float *ddx, float *ddy, VEC3 *frag_color, float *frag_depth);
+void simple_fs_quad(S3D_CONTEXT *ctx, void *uniform_buffer, const bool *masks, FS_LANES *varying, FS_LANES *frag_color, FS_LANES *frag_depth);
+
+// Textured forward shading
+extern const SHADER_SOURCE simple_shader_source;
+// Same vertex shader without any fragment shading
+extern const SHADER_SOURCE depth_shader_source;
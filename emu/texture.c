@@ -26,10 +26,11 @@
 #include "stb_image.h"
 #include "engine.h"
 
-TEXTURE texture_load(char *fname, char *name) {
+TEXTURE texture_load(S3D_CONTEXT *ctx, char *fname, char *name) {
     TEXTURE texture;
 
-    stbi_set_flip_vertically_on_load(true);
+    // Contexts may load textures from different threads
+    stbi_set_flip_vertically_on_load_thread(true);
     unsigned char *buf = stbi_load(
         fname,
         &texture.width,
@@ -41,14 +42,14 @@ TEXTURE texture_load(char *fname, char *name) {
 
     texture.name = strdup(name);
 
-    texture.id = s3d_load_tex(buf, texture.width, texture.height, texture.channels, 1);
+    texture.id = s3d_load_tex(ctx, buf, texture.width, texture.height, texture.channels, 1);
 
     stbi_image_free(buf);
 
     return texture;
 }
 
-void texture_free(TEXTURE *texture) {
+void texture_free(S3D_CONTEXT *ctx, TEXTURE *texture) {
     free(texture->name);
-    s3d_delete_tex(texture->id);
+    s3d_delete_tex(ctx, texture->id);
 }
@@ -30,5 +30,5 @@ typedef struct {
     int32_t channels;
 } TEXTURE;
 
-TEXTURE texture_load(char *fname, char *name);
-void texture_free(TEXTURE *texture);
+TEXTURE texture_load(S3D_CONTEXT *ctx, char *fname, char *name);
+void texture_free(S3D_CONTEXT *ctx, TEXTURE *texture);
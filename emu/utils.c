@@ -139,6 +139,18 @@ void ra_push(RESIZABLE_ARRAY *ra, void *val) {
 	ra->used_size++;
 }
 
+void ra_push_array(RESIZABLE_ARRAY *ra, void *vals, size_t count) {
+	if ((ra->used_size + count) > ra->allocated_size) {
+		while ((ra->used_size + count) > ra->allocated_size)
+			ra->allocated_size *= 2;
+		ra->buf = realloc(ra->buf, ra->allocated_size * ra->element_size);
+		assert(ra->buf);
+	}
+	memcpy((void *)((intptr_t)ra->buf + ra->used_size * ra->element_size), vals,
+			count * ra->element_size);
+	ra->used_size += count;
+}
+
 void ra_downsize(RESIZABLE_ARRAY *ra) {
 	ra->allocated_size = ra->used_size;
 	ra->buf = realloc(ra->buf, ra->allocated_size * ra->element_size);
@@ -38,6 +38,8 @@ void free_tokens(char **tokens, int num_tokens);
 void ra_init(RESIZABLE_ARRAY *ra, size_t element_size);
 void ra_deinit(RESIZABLE_ARRAY *ra);
 void ra_push(RESIZABLE_ARRAY *ra, void *val);
+// Push count elements at once
+void ra_push_array(RESIZABLE_ARRAY *ra, void *vals, size_t count);
 void ra_downsize(RESIZABLE_ARRAY *ra);
 
 // Prints